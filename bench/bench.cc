@@ -0,0 +1,688 @@
+// Copyright 2025 The Fuse-Archive Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of fuse-archive's core data structures, on synthetic inputs.
+// Reports the time and the number of heap allocations per operation.
+//
+// Usage: bench [filter]
+//        bench --archive=FILE...
+//
+// Only runs the benchmarks whose name contains the optional filter.
+//
+// With --archive, measures instead the sequential decode throughput of the
+// given archives, and the cost of positioning a cold Reader in their middle
+// and at their end. Prints a JSON object per archive.
+//
+// Set FUSE_ARCHIVE_SLOW_IO to emulate slow storage, e.g.
+// FUSE_ARCHIVE_SLOW_IO=latency=8000,bandwidth=100000000 for a HDD.
+
+#define FUSE_ARCHIVE_NO_MAIN
+#include "main.cc"
+
+#include <new>
+#include <random>
+#include <thread>
+
+// ---- Allocation Counting
+
+// With glibc, malloc, calloc and realloc are interposed, so that the buffers
+// that fuse-archive allocates for libfuse and the allocations made by
+// libarchive are counted too. Elsewhere, only operator new is counted.
+
+// GCC doesn't realize that the replaced operator new below uses malloc.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+namespace {
+std::atomic<std::int64_t> g_allocation_count = 0;
+
+void CountAllocation() {
+  g_allocation_count.fetch_add(1, std::memory_order_relaxed);
+}
+}  // namespace
+
+#ifdef __GLIBC__
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+
+void* malloc(size_t const n) {
+  CountAllocation();
+  return __libc_malloc(n);
+}
+
+void* calloc(size_t const n, size_t const size) {
+  CountAllocation();
+  return __libc_calloc(n, size);
+}
+
+void* realloc(void* const p, size_t const n) {
+  CountAllocation();
+  return __libc_realloc(p, n);
+}
+}  // extern "C"
+#endif
+
+void* operator new(size_t const n) {
+#ifndef __GLIBC__
+  CountAllocation();
+#endif
+  if (void* const p = std::malloc(n ?: 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t const n) {
+  return operator new(n);
+}
+
+void operator delete(void* const p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* const p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* const p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* const p, size_t) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+// ---- Benchmark Harness
+
+// Filter passed on the command line.
+std::string_view g_filter;
+
+// Prevents the compiler from optimizing away a computed value.
+template <typename T>
+void DoNotOptimize(T const& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Runs `fn` repeatedly, and reports the time and allocations per call. The
+// setup function, if any, is run before each batch and is not measured.
+void Run(std::string_view const name,
+         std::function<void()> const& fn,
+         std::function<void()> const& setup = nullptr) {
+  if (name.find(g_filter) == name.npos) {
+    return;
+  }
+
+  constexpr i64 min_nanoseconds = 200'000'000;
+  i64 batch = 1;
+  while (true) {
+    if (setup) {
+      setup();
+    }
+
+    std::int64_t const allocations = g_allocation_count.load();
+    Timer const timer;
+    for (i64 i = 0; i < batch; ++i) {
+      fn();
+    }
+
+    i64 const elapsed = timer.Nanoseconds();
+    if (elapsed >= min_nanoseconds || batch >= (i64(1) << 30)) {
+      std::int64_t const allocs = g_allocation_count.load() - allocations;
+      std::printf("%-40s %12lld ops %12.1f ns/op %10.2f allocs/op\n",
+                  std::string(name).c_str(), static_cast<long long>(batch),
+                  double(elapsed) / batch, double(allocs) / batch);
+      return;
+    }
+
+    batch = elapsed > 0 ? std::max(batch * 2, batch * min_nanoseconds /
+                                                  elapsed * 12 / 10)
+                        : batch * 100;
+  }
+}
+
+// Runs `fn` on the given number of threads for a while, and reports the time
+// per call over all the threads. The argument of `fn` is the thread number.
+void RunParallel(std::string_view const name,
+                 int const threads,
+                 std::function<void(int)> const& fn) {
+  if (name.find(g_filter) == name.npos) {
+    return;
+  }
+
+  std::atomic<bool> stop = false;
+  std::atomic<i64> total = 0;
+  std::vector<std::thread> workers;
+  std::int64_t const allocations = g_allocation_count.load();
+  Timer const timer;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      i64 n = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        fn(t);
+        ++n;
+      }
+      total += n;
+    });
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  stop = true;
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+
+  i64 const elapsed = timer.Nanoseconds();
+  i64 const ops = std::max<i64>(total, 1);
+  std::int64_t const allocs = g_allocation_count.load() - allocations;
+  std::printf("%-40s %12lld ops %12.1f ns/op %10.2f allocs/op\n",
+              std::string(name).c_str(), static_cast<long long>(ops),
+              double(elapsed) / ops, double(allocs) / ops);
+}
+
+// ---- Synthetic Inputs
+
+// Makes a set of paths shaped like the ones found in real archives.
+std::vector<std::string> MakePaths(int const n, int const seed = 1) {
+  std::mt19937 rng(seed);
+  std::vector<std::string> paths;
+  paths.reserve(n);
+  const char* const exts[] = {".txt", ".tar.gz", ".jpeg", "", ".c", ".h"};
+  for (int i = 0; i < n; ++i) {
+    std::string path;
+    int const depth = 1 + rng() % 6;
+    for (int d = 0; d < depth; ++d) {
+      path += StrCat("dir", rng() % 16, "/");
+    }
+    path += StrCat("file ", i, exts[rng() % std::size(exts)]);
+    paths.push_back(std::move(path));
+  }
+  return paths;
+}
+
+// Creates the root node if necessary.
+void EnsureRootNode() {
+  if (g_root_node) {
+    return;
+  }
+
+  g_root_node =
+      new Node{.name = "/",
+               .mode = static_cast<mode_t>(S_IFDIR | (0777 & ~g_options.dmask)),
+               .nlink = 2};
+}
+
+// Adds a file node at the given normalized path.
+Node* AddFileNode(std::string_view const path) {
+  auto const [parent_path, name] = Path(path).Split();
+  Node* const parent = GetOrCreateDirNode(parent_path);
+  Node* const node =
+      new Node{.name = std::string(name),
+               .mode = static_cast<mode_t>(S_IFREG | 0644),
+               .index_within_archive = 1};
+  parent->AddChild(node);
+  RenameIfCollision(node);
+  return node;
+}
+
+// Opens the given archive file as the archive to read.
+void OpenArchive(const std::string& path) {
+  int const fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    PLOG(ERROR) << "Cannot open " << Path(path);
+    throw ExitCode::CANNOT_OPEN_ARCHIVE;
+  }
+
+  Reader::DeleteRecycled();
+  if (g_archive_fd >= 0) {
+    close(g_archive_fd);
+  }
+
+  g_archive_fd = fd;
+  g_archive_size = lseek(fd, 0, SEEK_END);
+}
+
+// Writes a synthetic archive with the given number of entries and filter into
+// a temporary file, and opens it as the archive to read.
+void MakeArchive(int const entries,
+                 int const entry_size,
+                 int const filter = ARCHIVE_FILTER_NONE) {
+  char path[] = "/tmp/fuse-archive-bench-XXXXXX";
+  int const fd = mkstemp(path);
+  if (fd < 0) {
+    PLOG(ERROR) << "Cannot create temp file";
+    throw ExitCode::GENERIC_FAILURE;
+  }
+
+  unlink(path);
+
+  Archive* const a = archive_write_new();
+  archive_write_set_format_pax_restricted(a);
+  archive_write_add_filter(a, filter);
+  if (archive_write_open_fd(a, fd) != ARCHIVE_OK) {
+    LOG(ERROR) << "Cannot write archive: " << GetErrorString(a);
+    throw ExitCode::GENERIC_FAILURE;
+  }
+
+  std::mt19937 rng(42);
+  std::vector<char> data(entry_size);
+  Entry* const e = archive_entry_new();
+  for (int i = 0; i < entries; ++i) {
+    for (char& c : data) {
+      c = 'a' + rng() % 4;
+    }
+
+    archive_entry_clear(e);
+    std::string const name = StrCat("dir", i % 10, "/file", i);
+    archive_entry_set_pathname(e, name.c_str());
+    archive_entry_set_filetype(e, AE_IFREG);
+    archive_entry_set_perm(e, 0644);
+    archive_entry_set_size(e, entry_size);
+    archive_write_header(a, e);
+    archive_write_data(a, data.data(), data.size());
+  }
+
+  archive_entry_free(e);
+  archive_write_close(a);
+  archive_write_free(a);
+
+  // The recycled Readers point to the previous archive.
+  Reader::DeleteRecycled();
+  if (g_archive_fd >= 0) {
+    close(g_archive_fd);
+  }
+
+  g_archive_fd = fd;
+  g_archive_size = lseek(fd, 0, SEEK_END);
+}
+
+// ---- Benchmarks
+
+void BenchPath() {
+  std::vector<std::string> const paths = MakePaths(1024);
+  std::vector<std::string> messy;
+  for (const std::string& path : paths) {
+    messy.push_back(StrCat("./", path.substr(0, 4), "/./", path.substr(4),
+                           "//"));
+  }
+
+  size_t i = 0;
+  Run("Path::Normalized", [&] {
+    DoNotOptimize(Path(paths[i++ % paths.size()]).Normalized());
+  });
+
+  Run("Path::Normalized/messy", [&] {
+    DoNotOptimize(Path(messy[i++ % messy.size()]).Normalized());
+  });
+
+  Run("Path::ExtensionPosition", [&] {
+    DoNotOptimize(Path(paths[i++ % paths.size()]).ExtensionPosition());
+  });
+}
+
+void BenchTree() {
+  EnsureRootNode();
+
+  Run("GetOrCreateDirNode/existing", [&] {
+    DoNotOptimize(GetOrCreateDirNode("/existing/a/b/c/d"));
+  });
+
+  int k = 0;
+  Run("GetOrCreateDirNode/new", [&] {
+    DoNotOptimize(GetOrCreateDirNode(StrCat("/new/", k++, "/x/y")));
+  });
+
+  std::vector<std::string> paths = MakePaths(100000, 2);
+  for (std::string& path : paths) {
+    path = Path(path).Normalized();
+    AddFileNode(path);
+  }
+
+  std::mt19937 rng(3);
+  Run("FindNode/hit", [&] {
+    DoNotOptimize(FindNode(paths[rng() % paths.size()]));
+  });
+
+  Run("FindNode/miss", [&] { DoNotOptimize(FindNode("/dir1/dir2/absent")); });
+
+  // A directory with many children.
+  std::vector<std::string> huge_paths;
+  for (int j = 0; j < 200000; ++j) {
+    huge_paths.push_back(StrCat("/huge/file ", j, ".txt"));
+    AddFileNode(huge_paths.back());
+  }
+
+  Run("FindNode/huge", [&] {
+    DoNotOptimize(FindNode(huge_paths[rng() % huge_paths.size()]));
+  });
+
+  // Every new node collides with the previous ones in the same directory.
+  int batch = 0;
+  Node* dir = nullptr;
+  int inserted = 0;
+  Run(
+      "RenameIfCollision/collisions",
+      [&] {
+        // Keep the directories small, otherwise the benchmark measures the
+        // quadratic cost of probing " (N)" suffixes.
+        if (++inserted % 64 == 0) {
+          dir = GetOrCreateDirNode(StrCat("/collisions/", batch++));
+        }
+        Node* const node =
+            new Node{.name = "file.txt",
+                     .mode = static_cast<mode_t>(S_IFREG | 0644),
+                     .index_within_archive = 1};
+        dir->AddChild(node);
+        RenameIfCollision(node);
+      },
+      [&] { dir = GetOrCreateDirNode(StrCat("/collisions/", batch++)); });
+
+  Run("RenameIfCollision/unique", [&] {
+    Node* const node = new Node{.name = StrCat("unique ", k++),
+                                .mode = static_cast<mode_t>(S_IFREG | 0644),
+                                .index_within_archive = 1};
+    g_root_node->AddChild(node);
+    RenameIfCollision(node);
+  });
+
+  // Stat records of the 200000 children of /huge, as listed by ReadDir.
+  const Node* const huge = FindNode("/huge");
+  Run("Node::GetStat/huge", [&] {
+    for (const Node& child : huge->children) {
+      struct stat const z = child.GetStat();
+      DoNotOptimize(child.name.c_str()[0]);
+      DoNotOptimize(z);
+    }
+  });
+
+  ComputeStats();
+  const StatRecord& r = g_stat_records[huge->stat_index];
+  Run("StatRecord/huge", [&] {
+    for (const StatRecord& child :
+         std::span(g_stat_records).subspan(r.first_child, r.child_count)) {
+      DoNotOptimize(child.name[0]);
+      DoNotOptimize(child.z);
+    }
+  });
+}
+
+void BenchSideBuffer() {
+  // Fill the side buffers with consecutive chunks of entry 1.
+  for (int i = 0; i < NUM_SIDE_BUFFERS; ++i) {
+    SideBufferMetadata& meta = g_side_buffer_metadata[i];
+    meta.index_within_archive = 1;
+    meta.offset_within_entry = i * SIDE_BUFFER_SIZE;
+    meta.length = SIDE_BUFFER_SIZE;
+    meta.lru_priority = ++SideBufferMetadata::next_lru_priority;
+  }
+
+  std::vector<char> dst(4096);
+  std::mt19937 rng(4);
+  Run("ReadFromSideBuffer/hit/4K", [&] {
+    i64 const offset =
+        rng() % (NUM_SIDE_BUFFERS * SIDE_BUFFER_SIZE / dst.size()) * dst.size();
+    DoNotOptimize(ReadFromSideBuffer(1, dst.data(), dst.size(), offset));
+  });
+
+  Run("ReadFromSideBuffer/miss", [&] {
+    DoNotOptimize(ReadFromSideBuffer(2, dst.data(), dst.size(), 0));
+  });
+}
+
+void BenchCacheRead() {
+  // A cache file holding 256 files of 64 KiB.
+  int const files = 256;
+  i64 const file_size = 64 << 10;
+  char path[] = "/tmp/fuse-archive-bench-XXXXXX";
+  int const fd = mkstemp(path);
+  if (fd < 0) {
+    PLOG(ERROR) << "Cannot create temp file";
+    throw ExitCode::GENERIC_FAILURE;
+  }
+
+  unlink(path);
+  std::vector<char> const data(file_size, 'x');
+  EnsureRootNode();
+  std::vector<std::string> paths;
+  for (int i = 0; i < files; ++i) {
+    std::ignore = write(fd, data.data(), data.size());
+    paths.push_back(StrCat("/cache/file ", i));
+    Node* const node = AddFileNode(paths.back());
+    node->size = file_size;
+    node->cache_offset = i * file_size;
+  }
+
+  g_cache = true;
+  g_cache_fd = fd;
+
+  // Opens a file, reads 4 KiB like FUSE does with the returned buffer, and
+  // closes the file. FUSE reads a file buffer into its own memory, and sends a
+  // memory buffer as is.
+  auto const read = [&](int const thread) {
+    thread_local std::mt19937 rng(thread);
+    thread_local char dst[4096];
+    fuse_file_info fi = {};
+    Open(paths[rng() % paths.size()].c_str(), &fi);
+    fuse_bufvec* v = nullptr;
+    ReadBuf(nullptr, &v, sizeof(dst), rng() % (file_size / sizeof(dst)) *
+                                          sizeof(dst), &fi);
+    if (const fuse_buf& b = v->buf[0]; b.flags & FUSE_BUF_IS_FD) {
+      DoNotOptimize(pread(b.fd, dst, b.size, b.pos));
+    } else {
+      DoNotOptimize(b.mem);
+      std::free(b.mem);
+    }
+    std::free(v);
+    Release(nullptr, &fi);
+  };
+
+  Run("CacheRead", [&] { read(0); });
+  for (int const threads : {1, 4, 16, 64}) {
+    RunParallel(StrCat("CacheRead/threads=", threads), threads, read);
+  }
+
+  g_mmap = true;
+  g_cache_size = files * file_size;
+  MapCacheFile();
+  Run("CacheRead/mmap", [&] { read(0); });
+  for (int const threads : {1, 4, 16, 64}) {
+    RunParallel(StrCat("CacheRead/mmap/threads=", threads), threads, read);
+  }
+
+  munmap(const_cast<char*>(g_cache_map), g_cache_size);
+  g_cache_map = nullptr;
+  g_cache_size = 0;
+  g_mmap = false;
+  g_cache = false;
+  g_cache_fd = -1;
+  close(fd);
+}
+
+void BenchReader() {
+  if (std::string_view("Reader::ReuseOrCreate").find(g_filter) ==
+      std::string_view::npos) {
+    return;
+  }
+
+  g_cache = false;
+
+  struct Case {
+    std::string_view name;
+    int filter;
+  };
+
+  for (Case const c : {Case{"tar", ARCHIVE_FILTER_NONE},
+                       Case{"tar.gz", ARCHIVE_FILTER_GZIP}}) {
+    int const entries = 1000;
+    int const entry_size = 4096;
+    MakeArchive(entries, entry_size, c.filter);
+
+    std::mt19937 rng(5);
+    Run(StrCat("Reader::ReuseOrCreate/", c.name, "/forward"), [&, i = 0]() mutable {
+      i = i % entries + 1;
+      DoNotOptimize(Reader::ReuseOrCreate(i, 0));
+    });
+
+    Run(StrCat("Reader::ReuseOrCreate/", c.name, "/random"), [&] {
+      DoNotOptimize(Reader::ReuseOrCreate(1 + rng() % entries,
+                                          rng() % entry_size));
+    });
+  }
+}
+
+// Measures how fast a Reader streams through or skips a big entry.
+void BenchReaderStream() {
+  if (std::string_view("Reader::Read Reader::AdvanceOffset").find(g_filter) ==
+      std::string_view::npos) {
+    return;
+  }
+
+  g_cache = false;
+
+  struct Case {
+    std::string_view name;
+    int filter;
+  };
+
+  for (Case const c : {Case{"tar", ARCHIVE_FILTER_NONE},
+                       Case{"tar.gz", ARCHIVE_FILTER_GZIP}}) {
+    i64 const entry_size = 16 << 20;
+    MakeArchive(1, entry_size, c.filter);
+
+    std::vector<char> dst(128 << 10);
+    Run(StrCat("Reader::Read/", c.name, "/16M"), [&] {
+      Reader r;
+      r.AdvanceIndex(1);
+      while (r.Read(dst.data(), dst.size()) > 0) {
+      }
+    });
+
+    Run(StrCat("Reader::AdvanceOffset/", c.name, "/16M"), [&] {
+      Reader r;
+      r.AdvanceIndex(1);
+      r.AdvanceOffset(entry_size);
+    });
+  }
+}
+
+// Measures the given archive file, and prints the results as JSON.
+void BenchFormat(const std::string& path) {
+  OpenArchive(path);
+
+  // Walk the headers only.
+  std::vector<i64> sizes;
+  Timer timer;
+  {
+    Reader r;
+    while (r.NextEntry()) {
+      sizes.push_back(r.GetEntrySize());
+    }
+  }
+  i64 const walk_ns = timer.Nanoseconds();
+  i64 const entries = sizes.size();
+
+  if (entries == 0) {
+    LOG(ERROR) << "No entries in " << Path(path);
+    throw ExitCode::INVALID_ARCHIVE_CONTENTS;
+  }
+
+  // Decode everything sequentially.
+  std::vector<std::byte> buffer(1 << 20);
+  i64 decoded = 0;
+  timer.Reset();
+  {
+    Reader r;
+    while (r.NextEntry()) {
+      while (ssize_t const n = r.Read(buffer.data(), buffer.size())) {
+        decoded += n;
+      }
+    }
+  }
+  i64 const decode_ns = timer.Nanoseconds();
+
+  // Positions a cold Reader at the given fraction of the decoded bytes, and
+  // returns the best time of a few runs.
+  auto const position = [&sizes, decoded](double const fraction) {
+    i64 index = 1;
+    i64 offset = decoded * fraction;
+    while (index < sizes.size() && offset >= sizes[index - 1]) {
+      offset -= sizes[index - 1];
+      index++;
+    }
+
+    i64 best = std::numeric_limits<i64>::max();
+    for (int i = 0; i < 3; ++i) {
+      Reader::DeleteRecycled();
+      Timer const timer;
+      DoNotOptimize(Reader::ReuseOrCreate(index, offset));
+      best = std::min(best, timer.Nanoseconds());
+    }
+    return best;
+  };
+
+  i64 const middle_ns = position(0.5);
+  i64 const end_ns = position(1);
+
+  std::string archive;
+  AppendJsonString(&archive, Path(path).Split().second);
+  std::printf(
+      "{\"archive\": %s, \"compressed_bytes\": %lld, \"entries\": %lld, "
+      "\"decoded_bytes\": %lld, \"walk_ms\": %.3f, \"decode_ms\": %.3f, "
+      "\"decode_mb_per_s\": %.1f, \"cold_middle_ms\": %.3f, "
+      "\"cold_end_ms\": %.3f}\n",
+      archive.c_str(), static_cast<long long>(g_archive_size),
+      static_cast<long long>(entries), static_cast<long long>(decoded),
+      walk_ns / 1e6, decode_ns / 1e6,
+      decode_ns ? decoded * 1e3 / decode_ns : 0, middle_ns / 1e6, end_ns / 1e6);
+  std::fflush(stdout);
+}
+
+}  // namespace
+
+int main(int const argc, char** const argv) try {
+  openlog("fuse-archive-bench", LOG_PERROR, LOG_USER);
+  SetLogLevel(LogLevel::ERROR);
+  SetUpSlowIo();
+
+  std::vector<std::string> archives;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view const arg = argv[i];
+    if (arg.starts_with("--archive=")) {
+      archives.emplace_back(arg.substr(10));
+    } else {
+      g_filter = arg;
+    }
+  }
+
+  if (!archives.empty()) {
+    for (const std::string& archive : archives) {
+      BenchFormat(archive);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  BenchPath();
+  BenchTree();
+  BenchSideBuffer();
+  BenchCacheRead();
+  BenchReader();
+  BenchReaderStream();
+  return EXIT_SUCCESS;
+} catch (ExitCode const e) {
+  return static_cast<int>(e);
+}
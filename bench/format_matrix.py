@@ -0,0 +1,135 @@
+#!/usr/bin/python3
+
+# Copyright 2025 The Fuse-Archive Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Per-format benchmark matrix.
+#
+# For each archive format and filter, generates archives with out/make_archive
+# and measures with 'out/bench --archive=...':
+# - the time to walk all the headers,
+# - the sequential decode throughput,
+# - the time for a cold Reader to reach the middle and the end of the archive.
+#
+# Usage:
+#   format_matrix.py [--output matrix.json] [archive...]
+#
+# The optional archives are measured too. This is the way to include formats
+# that cannot be generated, such as RAR and CAB.
+
+import argparse
+import json
+import logging
+import os
+import subprocess
+
+# Directory of this program.
+script_dir = os.path.dirname(os.path.realpath(__file__))
+
+out_dir = os.path.join(script_dir, '..', 'out')
+bench_program = os.path.join(out_dir, 'bench')
+make_archive_program = os.path.join(out_dir, 'make_archive')
+archives_dir = os.path.join(out_dir, 'archives')
+
+formats = [
+    'tar', 'tar.gz', 'tar.bz2', 'tar.xz', 'tar.lzma', 'tar.zst', 'tar.Z',
+    'cpio', 'zip', 'zip-store', 'zip-bzip2', 'zip-lzma', 'zip-xz', '7z',
+    '7z-bzip2', '7z-deflate', 'iso',
+]
+
+# Shapes of archives: many entries, and a single big entry.
+shapes = [
+    ('many-small', {'count': 4000, 'size': 16384}),
+    ('big-file', {'size': 128 << 20}),
+]
+
+
+# Generates an archive, unless it is already there.
+# Returns its path, or None if the format is not supported.
+def MakeArchive(shape, fmt, params):
+    suffix = ''.join(f'-{k}{v}' for k, v in sorted(params.items()))
+    path = os.path.join(archives_dir, f'{shape}{suffix}.{fmt}')
+    if os.path.exists(path):
+        return path
+
+    logging.info(f'Generating {path!r}')
+    os.makedirs(archives_dir, exist_ok=True)
+    p = subprocess.run(
+        [make_archive_program, *(f'--{k}={v}' for k, v in params.items()),
+         shape, fmt, path + '.tmp'],
+        capture_output=True, encoding='UTF-8',
+    )
+    if p.returncode != 0:
+        logging.warning(f'Cannot generate {fmt}: {p.stderr.strip()}')
+        if os.path.exists(path + '.tmp'):
+            os.remove(path + '.tmp')
+        return None
+
+    os.rename(path + '.tmp', path)
+    return path
+
+
+def Measure(path):
+    p = subprocess.run(
+        [bench_program, f'--archive={path}'],
+        capture_output=True, encoding='UTF-8',
+    )
+    if p.returncode != 0:
+        logging.warning(f'Cannot measure {path!r}: {p.stderr.strip()}')
+        return None
+    return json.loads(p.stdout)
+
+
+def PrintTable(rows):
+    columns = [
+        ('shape', '<10'), ('format', '<16'), ('compressed_bytes', '12d'),
+        ('entries', '8d'), ('walk_ms', '10.1f'), ('decode_mb_per_s', '10.1f'),
+        ('cold_middle_ms', '10.1f'), ('cold_end_ms', '10.1f'),
+    ]
+    print(' '.join(name.ljust(len(format(rows[0][name], spec)))
+                   for name, spec in columns) if rows else '')
+    for row in rows:
+        print(' '.join(format(row[name], spec) for name, spec in columns))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Per-format benchmark matrix')
+    parser.add_argument('archives', nargs='*', help='extra archives to measure')
+    parser.add_argument('--output', help='JSON output file')
+    args = parser.parse_args()
+
+    logging.getLogger().setLevel('INFO')
+
+    rows = []
+    for shape, params in shapes:
+        for fmt in formats:
+            path = MakeArchive(shape, fmt, params)
+            if path and (result := Measure(path)):
+                rows.append({'shape': shape, 'format': fmt, **result})
+
+    for path in args.archives:
+        if result := Measure(path):
+            rows.append({'shape': 'given', 'format': os.path.basename(path),
+                         **result})
+
+    PrintTable(rows)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(rows, f, indent=2)
+        logging.info(f'Wrote {args.output!r}')
+
+
+if __name__ == '__main__':
+    main()
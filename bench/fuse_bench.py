@@ -0,0 +1,362 @@
+#!/usr/bin/python3
+
+# Copyright 2025 The Fuse-Archive Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# End-to-end benchmarks of fuse-archive through the FUSE mount.
+#
+# Mounts archives in cache and nocache modes with direct_io, and measures:
+# - mount time,
+# - sequential read throughput,
+# - random 4K and 128K read IOPS and latency percentiles,
+# - find and stat storms,
+# - cp -r of the whole tree,
+# - concurrent readers at 1, 4, 16 and 64 threads.
+#
+# Usage:
+#   fuse_bench.py [--output report.json] [--stress] [archive...]
+#   fuse_bench.py --compare old.json new.json
+#
+# Without archives, runs on synthetic archives made by out/make_archive and
+# cached in out/archives. With --stress, these archives are much bigger (10
+# million files, multi-GB entries...) and take a while to generate. They are not
+# read back to be verified.
+
+import argparse
+import concurrent.futures
+import json
+import logging
+import os
+import random
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+# Directory of this program.
+script_dir = os.path.dirname(os.path.realpath(__file__))
+
+# Path of the FUSE mounter.
+mount_program = os.path.join(script_dir, '..', 'out', 'fuse-archive')
+
+# Path of the synthetic archive generator.
+make_archive_program = os.path.join(script_dir, '..', 'out', 'make_archive')
+
+# Directory of the generated archives.
+archives_dir = os.path.join(script_dir, '..', 'out', 'archives')
+
+# Number of concurrent readers to test.
+thread_counts = [1, 4, 16, 64]
+
+# Synthetic archives: (shape, format, parameters, stress parameters).
+synthetic_archives = [
+    ('tiny-files', 'zip', {'count': 100000}, {'count': 10000000}),
+    ('tiny-files', 'tar.gz', {'count': 100000}, {'count': 10000000}),
+    ('deep-tree', 'tar', {'count': 10000}, {'count': 1000000}),
+    ('wide-dir', 'zip', {'count': 50000}, {'count': 500000}),
+    ('many-small', '7z', {'count': 10000}, {'count': 100000}),
+    ('big-file', 'zip', {'size': 256 << 20}, {'size': 8 << 30}),
+    ('big-file', 'tar.xz', {'size': 256 << 20}, {'size': 4 << 30}),
+    ('sparse', 'tar', {'size': 1 << 30}, {'size': 64 << 30}),
+]
+
+
+# Computes latency percentiles in microseconds from a list of seconds.
+def Percentiles(latencies):
+    if not latencies:
+        return {}
+    q = statistics.quantiles(latencies, n=100, method='inclusive')
+    return {
+        'p50_us': q[49] * 1e6,
+        'p90_us': q[89] * 1e6,
+        'p99_us': q[98] * 1e6,
+        'max_us': max(latencies) * 1e6,
+    }
+
+
+# Mounted archive. Unmounts on exit.
+class Mount:
+    def __init__(self, archive, options):
+        self.archive = archive
+        self.options = options
+        self.tmp = tempfile.TemporaryDirectory()
+        self.path = self.tmp.name
+
+    def __enter__(self):
+        start = time.monotonic()
+        subprocess.run(
+            [mount_program, *self.options, self.archive, self.path],
+            check=True,
+            capture_output=True,
+            input='',
+            encoding='UTF-8',
+        )
+        # Wait for the mount point to be functional.
+        while os.stat(self.path).st_ino == 0:
+            time.sleep(0.01)
+        self.mount_seconds = time.monotonic() - start
+        return self
+
+    def __exit__(self, *args):
+        subprocess.run(['fusermount', '-u', '-z', self.path], check=True)
+        self.tmp.cleanup()
+
+
+# Lists the regular files of the mounted tree with their sizes.
+def ListFiles(root):
+    files = []
+    for dirpath, _, filenames in os.walk(root):
+        for name in filenames:
+            path = os.path.join(dirpath, name)
+            st = os.lstat(path)
+            if st.st_size > 0 and os.path.isfile(path):
+                files.append((path, st.st_size))
+    return files
+
+
+def BenchSequentialRead(files):
+    total = 0
+    start = time.monotonic()
+    for path, _ in files:
+        with open(path, 'rb', buffering=0) as f:
+            while chunk := f.read(1 << 20):
+                total += len(chunk)
+    seconds = time.monotonic() - start
+    return {
+        'bytes': total,
+        'seconds': seconds,
+        'mb_per_s': total / seconds / 1e6 if seconds else 0,
+    }
+
+
+# Issues random reads of the given size for about the given duration.
+def BenchRandomRead(files, block_size, duration, seed=1):
+    rng = random.Random(seed)
+    latencies = []
+    fds = {}
+    try:
+        deadline = time.monotonic() + duration
+        while time.monotonic() < deadline:
+            path, size = rng.choice(files)
+            fd = fds.get(path)
+            if fd is None:
+                fd = fds[path] = os.open(path, os.O_RDONLY)
+            offset = rng.randrange(max(size - block_size, 0) + 1)
+            offset -= offset % 4096
+            start = time.monotonic()
+            os.pread(fd, block_size, offset)
+            latencies.append(time.monotonic() - start)
+    finally:
+        for fd in fds.values():
+            os.close(fd)
+
+    seconds = sum(latencies)
+    return {
+        'ops': len(latencies),
+        'iops': len(latencies) / seconds if seconds else 0,
+        **Percentiles(latencies),
+    }
+
+
+def BenchFind(root):
+    start = time.monotonic()
+    out = subprocess.run(['find', root], check=True, capture_output=True)
+    seconds = time.monotonic() - start
+    return {'entries': out.stdout.count(b'\n'), 'seconds': seconds}
+
+
+def BenchStat(root):
+    paths = []
+    for dirpath, dirnames, filenames in os.walk(root):
+        paths.extend(os.path.join(dirpath, n) for n in dirnames + filenames)
+    latencies = []
+    for path in paths:
+        start = time.monotonic()
+        os.lstat(path)
+        latencies.append(time.monotonic() - start)
+    seconds = sum(latencies)
+    return {
+        'stats': len(paths),
+        'stats_per_s': len(paths) / seconds if seconds else 0,
+        **Percentiles(latencies),
+    }
+
+
+def BenchCopy(root):
+    with tempfile.TemporaryDirectory() as dst:
+        start = time.monotonic()
+        subprocess.run(
+            ['cp', '-r', root, os.path.join(dst, 'copy')], check=True
+        )
+        seconds = time.monotonic() - start
+    return {'seconds': seconds}
+
+
+def BenchConcurrentReaders(files, threads, duration):
+    block_size = 128 << 10
+    with concurrent.futures.ThreadPoolExecutor(max_workers=threads) as pool:
+        results = list(pool.map(
+            lambda i: BenchRandomRead(files, block_size, duration, seed=i),
+            range(threads),
+        ))
+    ops = sum(r['ops'] for r in results)
+    return {
+        'threads': threads,
+        'ops': ops,
+        'mb_per_s': ops * block_size / duration / 1e6,
+        'p99_us': max((r.get('p99_us', 0) for r in results), default=0),
+    }
+
+
+# Runs all the workloads on the given archive with the given options.
+def BenchArchive(archive, options, duration):
+    logging.info(f'Benchmarking {archive!r} with options {options}')
+    result = {}
+    # Bypass the kernel page cache, so that every read reaches fuse-archive.
+    # Otherwise, the random and concurrent reads would mostly measure the page
+    # cache filled by the previous workloads.
+    with Mount(archive, ['-o', 'direct_io', *options]) as m:
+        result['mount_seconds'] = m.mount_seconds
+        files = ListFiles(m.path)
+        if not files:
+            logging.warning(f'No files in {archive!r}')
+            return result
+
+        result['find'] = BenchFind(m.path)
+        result['stat'] = BenchStat(m.path)
+        result['sequential_read'] = BenchSequentialRead(files)
+        result['random_read_4k'] = BenchRandomRead(files, 4 << 10, duration)
+        result['random_read_128k'] = BenchRandomRead(files, 128 << 10, duration)
+        result['copy'] = BenchCopy(m.path)
+
+        # Concurrent readers only make sense in cache mode, since the nocache
+        # mode is single-threaded.
+        if 'nocache' not in options:
+            result['concurrent'] = [
+                BenchConcurrentReaders(files, n, duration)
+                for n in thread_counts
+            ]
+    return result
+
+
+# Generates a synthetic archive, unless it is already there. Unless verify is
+# false, make_archive reads the archive back to check it, which takes a lot of
+# time and memory for the stress archives.
+# Returns the path of the archive.
+def MakeArchive(shape, fmt, params, verify=True):
+    suffix = ''.join(f'-{k}{v}' for k, v in sorted(params.items()))
+    path = os.path.join(archives_dir, f'{shape}{suffix}.{fmt}')
+    if not os.path.exists(path):
+        logging.info(f'Generating {path!r}')
+        os.makedirs(archives_dir, exist_ok=True)
+        subprocess.run(
+            [make_archive_program,
+             *(f'--{k}={v}' for k, v in params.items()),
+             *([] if verify else ['--verify=0']),
+             shape, fmt, path + '.tmp'],
+            check=True,
+        )
+        os.rename(path + '.tmp', path)
+    return path
+
+
+def GetCommit():
+    try:
+        return subprocess.run(
+            ['git', 'rev-parse', '--short', 'HEAD'],
+            cwd=script_dir, check=True, capture_output=True, encoding='UTF-8',
+        ).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+# Flattens a nested report into {'a.b.c': number}.
+def Flatten(report, prefix=''):
+    flat = {}
+    if isinstance(report, dict):
+        for key, value in report.items():
+            flat.update(Flatten(value, f'{prefix}{key}.'))
+    elif isinstance(report, list):
+        for i, value in enumerate(report):
+            flat.update(Flatten(value, f'{prefix}{i}.'))
+    elif isinstance(report, (int, float)) and not isinstance(report, bool):
+        flat[prefix[:-1]] = report
+    return flat
+
+
+# Prints the relative differences between two reports.
+def Compare(old_path, new_path):
+    with open(old_path) as f:
+        old = Flatten(json.load(f)['results'])
+    with open(new_path) as f:
+        new = Flatten(json.load(f)['results'])
+    for key in sorted(old.keys() & new.keys()):
+        a, b = old[key], new[key]
+        change = (b - a) / a * 100 if a else 0
+        print(f'{key:<90} {a:>14.3f} {b:>14.3f} {change:>+8.1f}%')
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='End-to-end benchmarks of fuse-archive')
+    parser.add_argument('archives', nargs='*', help='archives to mount')
+    parser.add_argument('--output', default='-', help='JSON report file')
+    parser.add_argument('--duration', type=float, default=2.0,
+                        help='duration of each timed workload in seconds')
+    parser.add_argument('--stress', action='store_true',
+                        help='generate much bigger synthetic archives')
+    parser.add_argument('--compare', nargs=2, metavar=('OLD', 'NEW'),
+                        help='compare two JSON reports')
+    args = parser.parse_args()
+
+    logging.getLogger().setLevel('INFO')
+
+    if args.compare:
+        Compare(*args.compare)
+        return
+
+    archives = args.archives
+    if not archives:
+        archives = [
+            MakeArchive(shape, fmt, stress if args.stress else params,
+                        verify=not args.stress)
+            for shape, fmt, params, stress in synthetic_archives
+        ]
+
+    results = {}
+    for archive in archives:
+        name = os.path.basename(archive)
+        for mode, options in [('cache', []), ('nocache', ['-o', 'nocache'])]:
+            results[f'{name}/{mode}'] = BenchArchive(
+                archive, options, args.duration
+            )
+
+    report = {
+        'commit': GetCommit(),
+        'time': time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'results': results,
+    }
+
+    if args.output == '-':
+        json.dump(report, sys.stdout, indent=2)
+        print()
+    else:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2)
+        logging.info(f'Wrote {args.output!r}')
+
+
+if __name__ == '__main__':
+    main()
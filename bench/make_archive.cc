@@ -0,0 +1,547 @@
+// Copyright 2025 The Fuse-Archive Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Generates synthetic archives of various shapes and formats for stress tests
+// and benchmarks. The generated contents only depend on the parameters, so
+// that benchmarks are reproducible.
+//
+// Usage: make_archive [--count=N] [--size=N] [--depth=N] [--fanout=N]
+//                     [--seed=N] [--verify=0] SHAPE FORMAT OUTPUT
+//
+// The generated archive is read back and checked against the generated
+// entries, unless --verify=0 is given.
+//
+// Run without arguments to list the supported shapes and formats.
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+using i64 = std::int64_t;
+
+// Parameters of the generated archive.
+struct Params {
+  // Number of entries.
+  i64 count = 0;
+  // Size of each file in bytes.
+  i64 size = 0;
+  // Depth of the directory tree.
+  int depth = 0;
+  // Number of subdirectories of each directory.
+  int fanout = 0;
+  // Seed of the pseudo-random contents.
+  std::uint64_t seed = 1;
+};
+
+// An entry to write in the archive.
+struct EntrySpec {
+  std::string path;
+  bool is_dir = false;
+  i64 size = 0;
+  // Data segments (offset, length) of a sparse file. Empty if not sparse.
+  std::vector<std::pair<i64, i64>> sparse;
+};
+
+using Sink = std::function<void(const EntrySpec&)>;
+
+// A shape of archive, with its default parameters.
+struct Shape {
+  std::string_view name;
+  std::string_view description;
+  Params defaults;
+  std::function<void(const Params&, const Sink&)> generate;
+};
+
+// Lots of tiny files, 1000 per directory.
+void GenerateTinyFiles(const Params& p, const Sink& sink) {
+  for (i64 i = 0; i < p.count; ++i) {
+    char path[64];
+    std::snprintf(path, sizeof(path), "d%06lld/f%06lld",
+                  static_cast<long long>(i / 1000),
+                  static_cast<long long>(i % 1000));
+    sink({.path = path, .size = p.size});
+  }
+}
+
+// A deep tree of directories, with a file in each directory.
+void GenerateDeepTree(const Params& p, const Sink& sink) {
+  i64 n = 0;
+  std::function<void(const std::string&, int)> walk =
+      [&](const std::string& dir, int const depth) {
+        if (n >= p.count) {
+          return;
+        }
+
+        if (!dir.empty()) {
+          sink({.path = dir, .is_dir = true});
+        }
+
+        sink({.path = dir + "file.txt", .size = p.size});
+        ++n;
+
+        if (depth >= p.depth) {
+          return;
+        }
+
+        for (int i = 0; i < p.fanout; ++i) {
+          walk(dir + "level" + std::to_string(depth + 1) + "-" +
+                   std::to_string(i) + "/",
+               depth + 1);
+        }
+      };
+  walk("", 0);
+}
+
+// A single directory with lots of entries.
+void GenerateWideDir(const Params& p, const Sink& sink) {
+  sink({.path = "wide/", .is_dir = true});
+  for (i64 i = 0; i < p.count; ++i) {
+    sink({.path = "wide/file " + std::to_string(i) + ".txt", .size = p.size});
+  }
+}
+
+// Big files.
+void GenerateBigFiles(const Params& p, const Sink& sink) {
+  for (i64 i = 0; i < p.count; ++i) {
+    sink({.path = "big" + std::to_string(i) + ".bin", .size = p.size});
+  }
+}
+
+// Sparse files, with 64 KiB of data every MiB.
+void GenerateSparseFiles(const Params& p, const Sink& sink) {
+  for (i64 i = 0; i < p.count; ++i) {
+    EntrySpec e = {.path = "sparse" + std::to_string(i) + ".bin",
+                   .size = p.size};
+    for (i64 offset = 0; offset < p.size; offset += 1 << 20) {
+      e.sparse.emplace_back(offset, std::min<i64>(64 << 10, p.size - offset));
+    }
+    sink(e);
+  }
+}
+
+Shape const shapes[] = {
+    {"tiny-files", "many tiny files (--count, --size)",
+     {.count = 100000, .size = 16}, GenerateTinyFiles},
+    {"deep-tree", "deep directory tree (--depth, --fanout, --count, --size)",
+     {.count = 100000, .size = 100, .depth = 20, .fanout = 2},
+     GenerateDeepTree},
+    {"wide-dir", "single directory with many entries (--count, --size)",
+     {.count = 500000, .size = 32}, GenerateWideDir},
+    {"many-small", "many small files, e.g. for a solid 7z (--count, --size)",
+     {.count = 10000, .size = 4096}, GenerateTinyFiles},
+    {"big-file", "big files (--count, --size)",
+     {.count = 1, .size = i64(1) << 30}, GenerateBigFiles},
+    {"sparse", "sparse files, only in tar formats (--count, --size)",
+     {.count = 1, .size = i64(256) << 20}, GenerateSparseFiles},
+};
+
+// An archive format, and how to set up a libarchive writer for it.
+struct Format {
+  std::string_view name;
+  int (*set_format)(archive*);
+  int filter = ARCHIVE_FILTER_NONE;
+  const char* options = nullptr;
+};
+
+Format const formats[] = {
+    {"tar", archive_write_set_format_pax_restricted},
+    {"tar.gz", archive_write_set_format_pax_restricted, ARCHIVE_FILTER_GZIP,
+     "gzip:!timestamp"},
+    {"tar.bz2", archive_write_set_format_pax_restricted, ARCHIVE_FILTER_BZIP2},
+    {"tar.xz", archive_write_set_format_pax_restricted, ARCHIVE_FILTER_XZ},
+    {"tar.lzma", archive_write_set_format_pax_restricted, ARCHIVE_FILTER_LZMA},
+    {"tar.zst", archive_write_set_format_pax_restricted, ARCHIVE_FILTER_ZSTD},
+    {"tar.Z", archive_write_set_format_pax_restricted, ARCHIVE_FILTER_COMPRESS},
+    {"cpio", archive_write_set_format_cpio_newc},
+    {"zip", archive_write_set_format_zip, ARCHIVE_FILTER_NONE,
+     "zip:compression=deflate"},
+    {"zip-store", archive_write_set_format_zip, ARCHIVE_FILTER_NONE,
+     "zip:compression=store"},
+    {"zip-bzip2", archive_write_set_format_zip, ARCHIVE_FILTER_NONE,
+     "zip:compression=bzip2"},
+    {"zip-lzma", archive_write_set_format_zip, ARCHIVE_FILTER_NONE,
+     "zip:compression=lzma"},
+    {"zip-xz", archive_write_set_format_zip, ARCHIVE_FILTER_NONE,
+     "zip:compression=xz"},
+    {"7z", archive_write_set_format_7zip, ARCHIVE_FILTER_NONE,
+     "7zip:compression=lzma2"},
+    {"7z-bzip2", archive_write_set_format_7zip, ARCHIVE_FILTER_NONE,
+     "7zip:compression=bzip2"},
+    {"7z-deflate", archive_write_set_format_7zip, ARCHIVE_FILTER_NONE,
+     "7zip:compression=deflate"},
+    {"iso", archive_write_set_format_iso9660, ARCHIVE_FILTER_NONE,
+     "iso9660:rockridge,iso9660:joliet=long"},
+};
+
+// Fills a buffer with deterministic, somewhat compressible text.
+class ContentGenerator {
+ public:
+  ContentGenerator(std::uint64_t const seed, i64 const index)
+      : state_(seed * 0x9E3779B97F4A7C15 + index + 1) {}
+
+  void Fill(char* p, size_t n) {
+    static constexpr std::string_view words[] = {
+        "the ",    "quick ", "brown ", "fox ",    "jumps ",   "over ",
+        "lazy ",   "dog ",   "lorem ", "ipsum ",  "dolor ",   "sit ",
+        "amet ",   "archive ", "fuse ", "reader ", "entry\n", "index ",
+        "offset ", "block ", "cache ", "stream ", "zip ",     "tar "};
+    while (n > 0) {
+      std::string_view const w = words[Next() % std::size(words)];
+      size_t const k = std::min(n, w.size());
+      std::copy_n(w.data(), k, p);
+      p += k;
+      n -= k;
+    }
+  }
+
+ private:
+  std::uint64_t Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return state_;
+  }
+
+  std::uint64_t state_;
+};
+
+void Check(archive* const a, int const status, const char* const what) {
+  if (status < ARCHIVE_WARN) {
+    std::fprintf(stderr, "Cannot %s: %s\n", what,
+                 archive_error_string(a) ?: "Not supported by this libarchive");
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+// Calls `out` with successive chunks of the logical contents of a file entry:
+// zeros in the holes of a sparse file, and generated text elsewhere.
+void GenerateContents(const EntrySpec& spec,
+                      ContentGenerator& content,
+                      std::vector<char>& buffer,
+                      const std::function<void(const char*, size_t)>& out) {
+  i64 pos = 0;
+  auto emit = [&](i64 const end, bool const data) {
+    while (pos < end) {
+      size_t const n = std::min<i64>(end - pos, buffer.size());
+      if (data) {
+        content.Fill(buffer.data(), n);
+      } else {
+        std::memset(buffer.data(), 0, n);
+      }
+      out(buffer.data(), n);
+      pos += n;
+    }
+  };
+
+  if (spec.sparse.empty()) {
+    emit(spec.size, true);
+    return;
+  }
+
+  for (const auto& [offset, length] : spec.sparse) {
+    emit(offset, false);
+    emit(offset + length, true);
+  }
+  emit(spec.size, false);
+}
+
+void Write(const Shape& shape,
+           const Format& format,
+           const Params& params,
+           const char* const output) {
+  archive* const a = archive_write_new();
+  Check(a, format.set_format(a), "set format");
+  Check(a, archive_write_add_filter(a, format.filter), "add filter");
+  // Some compression methods depend on the version of libarchive.
+  if (format.options) {
+    Check(a, archive_write_set_options(a, format.options),
+          "set format options");
+  }
+  Check(a, archive_write_open_filename(a, output), "open output");
+
+  // Fixed timestamp for reproducibility: 2020-01-01 00:00:00 UTC.
+  time_t const mtime = 1577836800;
+
+  archive_entry* const e = archive_entry_new();
+  std::vector<char> buffer(1 << 20);
+  i64 index = 0;
+
+  shape.generate(params, [&](const EntrySpec& spec) {
+    archive_entry_clear(e);
+    archive_entry_set_pathname(e, spec.path.c_str());
+    archive_entry_set_mtime(e, mtime, 0);
+    if (spec.is_dir) {
+      archive_entry_set_filetype(e, AE_IFDIR);
+      archive_entry_set_perm(e, 0755);
+      // Some formats, e.g. cpio, need the size of directories too.
+      archive_entry_set_size(e, 0);
+      Check(a, archive_write_header(a, e), "write header");
+      return;
+    }
+
+    archive_entry_set_filetype(e, AE_IFREG);
+    archive_entry_set_perm(e, 0644);
+    archive_entry_set_size(e, spec.size);
+    for (const auto& [offset, length] : spec.sparse) {
+      archive_entry_sparse_add_entry(e, offset, length);
+    }
+    Check(a, archive_write_header(a, e), "write header");
+
+    // The writer takes the whole logical contents, and drops the bytes
+    // falling in the holes of a sparse file.
+    ContentGenerator content(params.seed, index++);
+    GenerateContents(spec, content, buffer,
+                     [&](const char* const p, size_t const n) {
+                       la_ssize_t const k = archive_write_data(a, p, n);
+                       Check(a, k < 0 ? int(k) : ARCHIVE_OK, "write data");
+                     });
+  });
+
+  archive_entry_free(e);
+  Check(a, archive_write_close(a), "close output");
+  archive_write_free(a);
+}
+
+// Reads the archive back, and checks that each file has the expected contents.
+void Verify(const Shape& shape, const Params& params, const char* const input) {
+  // Regular files by path, with their index for the content generator.
+  struct Expected {
+    EntrySpec spec;
+    i64 index;
+    bool seen = false;
+  };
+
+  std::unordered_map<std::string, Expected> expected;
+  i64 index = 0;
+  shape.generate(params, [&](const EntrySpec& spec) {
+    if (!spec.is_dir) {
+      expected.try_emplace(spec.path, Expected{spec, index++});
+    }
+  });
+
+  archive* const a = archive_read_new();
+  Check(a, archive_read_support_filter_all(a), "support filters");
+  Check(a, archive_read_support_format_all(a), "support formats");
+  Check(a, archive_read_open_filename(a, input, 1 << 20), "open archive");
+
+  auto fail = [](const char* const path, const char* const what) {
+    std::fprintf(stderr, "Verification failed for '%s': %s\n", path, what);
+    std::exit(EXIT_FAILURE);
+  };
+
+  std::vector<char> buffer(1 << 20);
+  std::vector<char> actual(buffer.size());
+  i64 files = 0;
+  archive_entry* e;
+  while (true) {
+    int const status = archive_read_next_header(a, &e);
+    if (status == ARCHIVE_EOF) {
+      break;
+    }
+
+    Check(a, status, "read header");
+    if (archive_entry_filetype(e) != AE_IFREG) {
+      continue;
+    }
+
+    const char* const path = archive_entry_pathname(e);
+    auto const it = expected.find(path);
+    if (it == expected.end()) {
+      fail(path, "unexpected entry");
+    }
+
+    Expected& x = it->second;
+    if (x.seen) {
+      fail(path, "duplicate entry");
+    }
+
+    x.seen = true;
+    ++files;
+    if (archive_entry_size(e) != x.spec.size) {
+      fail(path, "wrong size");
+    }
+
+    // Reads the data blocks, and fills the holes between them with zeros.
+    // archive_read_data() doesn't fill a hole at the end of a sparse file.
+    const void* block = nullptr;
+    size_t block_size = 0;
+    la_int64_t block_offset = 0;
+    bool eof = false;
+    i64 pos = 0;
+    auto read = [&](char* p, size_t n) {
+      while (n > 0) {
+        if (!eof && pos >= block_offset + i64(block_size)) {
+          int const status =
+              archive_read_data_block(a, &block, &block_size, &block_offset);
+          if (status == ARCHIVE_EOF) {
+            eof = true;
+          } else {
+            Check(a, status, "read data");
+            if (block_offset < pos) {
+              fail(path, "overlapping data blocks");
+            }
+          }
+          continue;
+        }
+
+        size_t k = n;
+        if (eof) {
+          std::memset(p, 0, k);
+        } else if (pos < block_offset) {
+          k = std::min<i64>(k, block_offset - pos);
+          std::memset(p, 0, k);
+        } else {
+          k = std::min<i64>(k, block_offset + i64(block_size) - pos);
+          std::memcpy(p, static_cast<const char*>(block) + (pos - block_offset),
+                      k);
+        }
+
+        p += k;
+        n -= k;
+        pos += k;
+      }
+    };
+
+    ContentGenerator content(params.seed, x.index);
+    GenerateContents(x.spec, content, buffer,
+                     [&](const char* const p, size_t const n) {
+                       read(actual.data(), n);
+                       if (std::memcmp(p, actual.data(), n) != 0) {
+                         fail(path, "wrong contents");
+                       }
+                     });
+
+    while (!eof) {
+      int const status =
+          archive_read_data_block(a, &block, &block_size, &block_offset);
+      if (status == ARCHIVE_EOF) {
+        eof = true;
+      } else {
+        Check(a, status, "read data");
+        if (block_size > 0) {
+          fail(path, "trailing contents");
+        }
+      }
+    }
+  }
+
+  if (files != static_cast<i64>(expected.size())) {
+    std::fprintf(stderr, "Verification failed: found %lld of %zu files\n",
+                 static_cast<long long>(files), expected.size());
+    std::exit(EXIT_FAILURE);
+  }
+
+  archive_read_free(a);
+}
+
+void PrintUsage() {
+  std::fprintf(stderr,
+               "usage: make_archive [--count=N] [--size=N] [--depth=N] "
+               "[--fanout=N] [--seed=N] [--verify=0] SHAPE FORMAT OUTPUT\n\nshapes:\n");
+  for (const Shape& s : shapes) {
+    std::fprintf(stderr, "    %-12s %s\n", s.name.data(), s.description.data());
+  }
+
+  std::fprintf(stderr, "\nformats:\n   ");
+  for (const Format& f : formats) {
+    std::fprintf(stderr, " %s", f.name.data());
+  }
+  std::fprintf(stderr, "\n");
+}
+
+}  // namespace
+
+int main(int const argc, char** const argv) {
+  std::vector<std::string_view> args;
+  std::vector<std::pair<std::string_view, i64>> overrides;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view const arg = argv[i];
+    if (arg.starts_with("--")) {
+      size_t const eq = arg.find('=');
+      if (eq == arg.npos) {
+        PrintUsage();
+        return EXIT_FAILURE;
+      }
+      overrides.emplace_back(arg.substr(2, eq - 2),
+                             std::strtoll(arg.data() + eq + 1, nullptr, 0));
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  if (args.size() != 3) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  const Shape* shape = nullptr;
+  for (const Shape& s : shapes) {
+    if (s.name == args[0]) {
+      shape = &s;
+    }
+  }
+
+  const Format* format = nullptr;
+  for (const Format& f : formats) {
+    if (f.name == args[1]) {
+      format = &f;
+    }
+  }
+
+  if (!shape || !format) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  Params params = shape->defaults;
+  bool verify = true;
+  for (const auto& [key, value] : overrides) {
+    if (key == "count") {
+      params.count = value;
+    } else if (key == "size") {
+      params.size = value;
+    } else if (key == "depth") {
+      params.depth = value;
+    } else if (key == "fanout") {
+      params.fanout = value;
+    } else if (key == "seed") {
+      params.seed = value;
+    } else if (key == "verify") {
+      verify = value != 0;
+    } else {
+      PrintUsage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  Write(*shape, *format, params, args[2].data());
+  if (verify) {
+    Verify(*shape, params, args[2].data());
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -22,15 +22,19 @@
 #include <fuse.h>
 #include <langinfo.h>
 #include <locale.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syslog.h>
 #include <sys/types.h>
 #include <syslog.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
 #include <cerrno>
 #include <chrono>
@@ -47,12 +51,16 @@
 #include <limits>
 #include <locale>
 #include <memory>
+#include <mutex>
 #include <ostream>
+#include <span>
 #include <sstream>
 #include <string>
 #include <string_view>
 #include <system_error>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -60,7 +68,14 @@
 
 #include <boost/intrusive/list.hpp>
 #include <boost/intrusive/slist.hpp>
-#include <boost/intrusive/unordered_set.hpp>
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+
+#if __has_include(<sys/sysmacros.h>)
+#include <sys/sysmacros.h>
+#endif
 
 // ---- Compile-time Configuration
 
@@ -92,6 +107,13 @@ struct Timer {
         .count();
   }
 
+  // Elapsed time in nanoseconds.
+  auto Nanoseconds() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                                start)
+        .count();
+  }
+
   friend std::ostream& operator<<(std::ostream& out, const Timer& timer) {
     return out << timer.Milliseconds() << " ms";
   }
@@ -118,6 +140,7 @@ enum class ExitCode {
   INVALID_RAW_ARCHIVE = 30,
   INVALID_ARCHIVE_HEADER = 31,
   INVALID_ARCHIVE_CONTENTS = 32,
+  LIMIT_EXCEEDED = 40,
 };
 
 std::ostream& operator<<(std::ostream& out, ExitCode const e) {
@@ -136,6 +159,7 @@ std::ostream& operator<<(std::ostream& out, ExitCode const e) {
     PRINT(INVALID_RAW_ARCHIVE)
     PRINT(INVALID_ARCHIVE_HEADER)
     PRINT(INVALID_ARCHIVE_CONTENTS)
+    PRINT(LIMIT_EXCEEDED)
 #undef PRINT
   }
 
@@ -153,6 +177,10 @@ std::string_view GetErrorString(archive* const a) {
 #define lseek64 lseek
 #endif
 
+#ifndef ENODATA
+#define ENODATA ENOATTR
+#endif
+
 // ---- Globals
 
 enum {
@@ -167,6 +195,13 @@ enum {
   KEY_NO_SYMLINKS,
   KEY_NO_HARDLINKS,
   KEY_DEFAULT_PERMISSIONS,
+  KEY_STATS,
+  KEY_LIST,
+  KEY_LIST_JSON,
+  KEY_LIST_NUL,
+  KEY_TAR_EXPORT,
+  KEY_MANIFEST,
+  KEY_MMAP,
 #if FUSE_USE_VERSION >= 30
   KEY_DIRECT_IO,
 #endif
@@ -175,6 +210,22 @@ enum {
 struct Options {
   unsigned int dmask = 0022;
   unsigned int fmask = 0022;
+  // Path of the binary trace dump file, or null if tracing is off.
+  const char* trace = nullptr;
+  // Path of the JSON mount profile file, or null.
+  const char* profile = nullptr;
+  // Path of the FUSE operation recording file, or null.
+  const char* record = nullptr;
+  // Directory to extract the archive into, or null.
+  const char* extract = nullptr;
+  // Limits on the archive contents. Zero means no limit.
+  unsigned long long max_size = 0;
+  unsigned long long max_ratio = 0;
+  unsigned long long max_entries = 0;
+  unsigned long long max_depth = 0;
+  unsigned long long max_time = 0;
+  // Maximum size of the reads from the archive file.
+  unsigned long long read_size = 1 << 20;
 };
 
 Options g_options;
@@ -198,11 +249,29 @@ fuse_opt const g_fuse_opts[] = {
     FUSE_OPT_KEY("nosymlinks", KEY_NO_SYMLINKS),
     FUSE_OPT_KEY("nohardlinks", KEY_NO_HARDLINKS),
     FUSE_OPT_KEY("default_permissions", KEY_DEFAULT_PERMISSIONS),
+    FUSE_OPT_KEY("stats", KEY_STATS),
+    FUSE_OPT_KEY("--list", KEY_LIST),
+    FUSE_OPT_KEY("--list=text", KEY_LIST),
+    FUSE_OPT_KEY("--list=json", KEY_LIST_JSON),
+    FUSE_OPT_KEY("--list=nul", KEY_LIST_NUL),
+    FUSE_OPT_KEY("tarexport", KEY_TAR_EXPORT),
+    FUSE_OPT_KEY("manifest", KEY_MANIFEST),
+    FUSE_OPT_KEY("mmap", KEY_MMAP),
 #if FUSE_USE_VERSION >= 30
     FUSE_OPT_KEY("direct_io", KEY_DIRECT_IO),
 #endif
     {"dmask=%o", offsetof(Options, dmask)},
     {"fmask=%o", offsetof(Options, fmask)},
+    {"trace=%s", offsetof(Options, trace)},
+    {"profile=%s", offsetof(Options, profile)},
+    {"record=%s", offsetof(Options, record)},
+    {"--extract=%s", offsetof(Options, extract)},
+    {"maxsize=%llu", offsetof(Options, max_size)},
+    {"maxratio=%llu", offsetof(Options, max_ratio)},
+    {"maxentries=%llu", offsetof(Options, max_entries)},
+    {"maxdepth=%llu", offsetof(Options, max_depth)},
+    {"maxtime=%llu", offsetof(Options, max_time)},
+    {"readsize=%llu", offsetof(Options, read_size)},
     FUSE_OPT_END,
 };
 
@@ -216,10 +285,24 @@ bool g_specials = true;
 bool g_symlinks = true;
 bool g_hardlinks = true;
 bool g_default_permissions = false;
+bool g_stats = false;
+bool g_tar_export = false;
+bool g_manifest = false;
+bool g_mmap = false;
 #if FUSE_USE_VERSION >= 30
 bool g_direct_io = false;
 #endif
 
+// Output format of the --list mode.
+enum class ListFormat {
+  NONE,
+  TEXT,
+  JSON,
+  NUL,
+};
+
+ListFormat g_list = ListFormat::NONE;
+
 // Number of command line arguments seen so far.
 int g_arg_count = 0;
 
@@ -235,6 +318,13 @@ int g_cache_fd = -1;
 // Size of the cache file.
 i64 g_cache_size = 0;
 
+// Cache file mapped in memory with "-o mmap", or null.
+const char* g_cache_map = nullptr;
+
+// With "-o mmap", the files of at least this size start at a multiple of this
+// size in the cache file, so that their mapped data can use huge pages.
+constexpr i64 kHugePageSize = 2 << 20;
+
 // File descriptor returned by opening g_archive_path.
 int g_archive_fd = -1;
 
@@ -563,6 +653,46 @@ using LinkMode = bi::link_mode<bi::normal_link>;
 using LinkMode = bi::link_mode<bi::safe_link>;
 #endif
 
+struct Node;
+
+// Index of the children of a directory by name. Small directories keep their
+// children in a plain array searched linearly. Bigger directories switch to an
+// open-addressing hash table with linear probing, so that looking up a name
+// takes the same time whatever the size of the directory.
+class ChildIndex {
+ public:
+  // Finds the child with the given name, or null.
+  Node* Find(std::string_view name) const;
+
+  // Adds the given child, unless another child has the same name. Returns null
+  // if the child was added, or the other child with the same name.
+  Node* Insert(Node* child);
+
+  // Removes the given child.
+  void Erase(const Node* child);
+
+ private:
+  // Maximum number of children kept in a plain array.
+  static constexpr std::uint32_t kMaxLinear = 16;
+
+  bool IsHashed() const { return capacity_ > kMaxLinear; }
+
+  static std::uint32_t Hash(std::string_view const name) {
+    return static_cast<std::uint32_t>(std::hash<std::string_view>()(name));
+  }
+
+  // Gets the position in the hash table of the child with the given name, or
+  // of the empty slot where it would go.
+  std::uint32_t Probe(std::string_view name) const;
+
+  // Moves the children into a bigger array or hash table.
+  void Grow(std::uint32_t capacity);
+
+  std::unique_ptr<Node*[]> slots_;
+  std::uint32_t capacity_ = 0;
+  std::uint32_t size_ = 0;
+};
+
 struct Node {
   // Name of this node in the context of its parent. This name should be a valid
   // and non-empty filename, and it shouldn't contain any '/' separator. The
@@ -582,6 +712,22 @@ struct Node {
   i64 index_within_archive = 0;
   i64 size = 0;
 
+  // Position of the entry's header in the archive stream (after decompression
+  // filters such as gzip), and distance to the next header. These are -1 if
+  // unknown.
+  i64 archive_offset = -1;
+  i64 archive_length = -1;
+
+  // Index of the entry's format and compression method in g_format_names.
+  std::uint16_t format_id = 0;
+
+  // Position of this node's record in g_stat_records, or 0 if none.
+  std::uint32_t stat_index = 0;
+
+  // CRC-32 of the contents as stored in the archive's metadata, or -1 if
+  // unknown.
+  i64 crc32 = -1;
+
   // Where does the cached data start in the cache file?
   i64 cache_offset = std::numeric_limits<i64>::min();
 
@@ -613,9 +759,8 @@ struct Node {
                              bi::cache_last<true>>;
   Children children;
 
-  // Hooks used to index Nodes by full path.
-  using ByPath = bi::unordered_set_member_hook<LinkMode, bi::store_hash<true>>;
-  ByPath by_path;
+  // Children of this Node indexed by name.
+  ChildIndex children_by_name;
 
   FileType GetType() const { return GetFileType(mode); }
 
@@ -670,6 +815,118 @@ struct Node {
 
 ino_t Node::count = 0;
 
+std::uint32_t ChildIndex::Probe(std::string_view const name) const {
+  assert(IsHashed());
+  std::uint32_t const mask = capacity_ - 1;
+  for (std::uint32_t i = Hash(name) & mask;; i = (i + 1) & mask) {
+    const Node* const n = slots_[i];
+    if (!n || n->name == name) {
+      return i;
+    }
+  }
+}
+
+Node* ChildIndex::Find(std::string_view const name) const {
+  if (IsHashed()) {
+    return slots_[Probe(name)];
+  }
+
+  for (std::uint32_t i = 0; i < size_; ++i) {
+    if (slots_[i]->name == name) {
+      return slots_[i];
+    }
+  }
+
+  return nullptr;
+}
+
+Node* ChildIndex::Insert(Node* const child) {
+  assert(child);
+  if (!IsHashed()) {
+    if (Node* const n = Find(child->name)) {
+      return n;
+    }
+
+    if (size_ < capacity_) {
+      slots_[size_++] = child;
+      return nullptr;
+    }
+
+    // Switch to a hash table when the array is full.
+    Grow(capacity_ < kMaxLinear ? std::max<std::uint32_t>(2 * capacity_, 2)
+                                : 4 * kMaxLinear);
+    if (!IsHashed()) {
+      slots_[size_++] = child;
+      return nullptr;
+    }
+  }
+
+  std::uint32_t const i = Probe(child->name);
+  if (Node* const n = slots_[i]) {
+    return n;
+  }
+
+  slots_[i] = child;
+  // Keep the load factor below 1/2.
+  if (++size_ > capacity_ / 2) {
+    Grow(2 * capacity_);
+  }
+
+  return nullptr;
+}
+
+void ChildIndex::Erase(const Node* const child) {
+  assert(child);
+  if (!IsHashed()) {
+    for (std::uint32_t i = 0; i < size_; ++i) {
+      if (slots_[i] == child) {
+        slots_[i] = slots_[--size_];
+        slots_[size_] = nullptr;
+        return;
+      }
+    }
+
+    assert(false);
+    return;
+  }
+
+  // Remove the child, and shift back the following children that can get
+  // closer to their ideal position.
+  std::uint32_t const mask = capacity_ - 1;
+  std::uint32_t i = Probe(child->name);
+  assert(slots_[i] == child);
+  for (std::uint32_t j = (i + 1) & mask; slots_[j]; j = (j + 1) & mask) {
+    std::uint32_t const k = Hash(slots_[j]->name) & mask;
+    if (((j - k) & mask) >= ((j - i) & mask)) {
+      slots_[i] = slots_[j];
+      i = j;
+    }
+  }
+
+  slots_[i] = nullptr;
+  --size_;
+}
+
+void ChildIndex::Grow(std::uint32_t const capacity) {
+  std::unique_ptr<Node*[]> old = std::exchange(
+      slots_, std::make_unique_for_overwrite<Node*[]>(capacity));
+  std::uint32_t const old_capacity = std::exchange(capacity_, capacity);
+  std::fill_n(slots_.get(), capacity_, nullptr);
+
+  if (!IsHashed()) {
+    std::copy_n(old.get(), size_, slots_.get());
+    return;
+  }
+
+  for (std::uint32_t i = 0; i < old_capacity; ++i) {
+    if (Node* const n = old[i]) {
+      std::uint32_t const j = Probe(n->name);
+      assert(!slots_[j]);
+      slots_[j] = n;
+    }
+  }
+}
+
 std::ostream& operator<<(std::ostream& out, const Node& n) {
   return out << n.GetType() << " [" << n.index_within_archive << "] "
              << Path(n.GetPath());
@@ -681,28 +938,6 @@ std::ostream& operator<<(std::ostream& out, const Node& n) {
 // .tar.gz that are compressed but also do not contain an explicit on-disk
 // directory of archive entries.
 
-// Path extractor for Node.
-struct GetPath {
-  using type = std::string;
-  std::string operator()(const Node& node) const { return node.GetPath(); }
-};
-
-using NodesByPath =
-    bi::unordered_set<Node,
-                      bi::member_hook<Node, Node::ByPath, &Node::by_path>,
-                      bi::constant_time_size<true>,
-                      bi::power_2_buckets<true>,
-                      bi::compare_hash<true>,
-                      bi::key_of_value<GetPath>,
-                      bi::equal<std::equal_to<std::string_view>>,
-                      bi::hash<std::hash<std::string_view>>>;
-
-using Bucket = NodesByPath::bucket_type;
-using Buckets = std::vector<Bucket>;
-Buckets buckets(1 << 4);
-
-NodesByPath g_nodes_by_path({buckets.data(), buckets.size()});
-
 // Root node of the tree.
 Node* g_root_node = nullptr;
 
@@ -716,6 +951,10 @@ struct Hardlink {
 // Hard links to resolve.
 std::vector<Hardlink> g_hardlinks_to_resolve;
 
+// Names of the formats and compression methods of the archive entries, e.g.
+// "ZIP 2.0 (deflation)" or "GNU tar format + gzip".
+std::vector<std::string> g_format_names;
+
 // g_side_buffer_data and g_side_buffer_metadata combine to hold side buffers:
 // statically allocated buffers used as a destination for decompressed bytes
 // when Reader::advance_offset isn't a no-op. These buffers are roughly
@@ -826,7 +1065,9 @@ void SetLogLevel(LogLevel const level) {
 
 #define LOG_IS_ON(level) (LogLevel::level <= g_log_level)
 
-bool g_latest_log_is_ephemeral = false;
+// Was the latest message logged by this thread a progress message? Each
+// thread has its own flag, so that logging threads don't share a cache line.
+thread_local bool g_latest_log_is_ephemeral = false;
 
 enum class ProgressMessage : int;
 
@@ -881,6 +1122,447 @@ class Logger {
   if (LogLevel::level <= g_log_level) \
   Logger(LogLevel::level, errno)
 
+// ---- Static Tracepoints
+
+// USDT probes for bpftrace, perf or SystemTap. They are compiled in when
+// <sys/sdt.h> is available, and each of them is a single NOP instruction until
+// a tracer attaches to it. The probe notes survive stripping the binary. See
+// tools/bpftrace for some example scripts.
+#ifdef STAP_PROBEV
+#define PROBE(name, ...) STAP_PROBEV(fuse_archive, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) \
+  do {                   \
+  } while (false)
+#endif
+
+// ---- Trace Ring
+
+// The trace ring is a low-overhead alternative to LOG(DEBUG) for hot-path
+// events. When enabled with "-o trace=FILE", each thread appends fixed-size
+// binary records to its own ring buffer, without any lock and without any
+// formatting. The rings are dumped to FILE when receiving SIGUSR1 and when
+// exiting. The dump can be decoded with tools/trace_decode.py.
+//
+// When tracing is off, each trace point costs a single test of g_trace.
+
+enum class TraceEvent : std::uint16_t {
+  READER_CREATE = 1,
+  READER_DELETE = 2,
+  READER_REUSE = 3,
+  ADVANCE_INDEX = 4,
+  ADVANCE_OFFSET = 5,
+  READER_READ = 6,
+  SIDE_BUFFER_HIT = 7,
+  SIDE_BUFFER_MISS = 8,
+  FUSE_OPEN = 9,
+  FUSE_READ = 10,
+  FUSE_RELEASE = 11,
+};
+
+// A trace record. Its layout is part of the dump file format.
+struct TraceRecord {
+  // Start time in nanoseconds, from CLOCK_MONOTONIC.
+  std::uint64_t timestamp;
+  // Duration in nanoseconds, or 0 for instantaneous events.
+  std::uint64_t duration;
+  i64 index_within_archive;
+  i64 offset_within_entry;
+  i64 length;
+  std::uint32_t reader_id;
+  std::uint16_t thread_id;
+  TraceEvent event;
+};
+
+static_assert(sizeof(TraceRecord) == 48);
+
+// Per-thread ring buffer of trace records. Only its owner thread writes into
+// it. The head counter is only advanced after the record has been written.
+struct TraceRing {
+  static constexpr std::uint64_t size = 4096;
+  std::uint16_t thread_id = 0;
+  std::atomic<std::uint64_t> head = 0;
+  TraceRecord records[size];
+};
+
+// Is tracing enabled?
+bool g_trace = false;
+
+// Directory against which a relative trace file path is resolved, since the
+// current directory changes when daemonizing.
+int g_trace_dir_fd = AT_FDCWD;
+
+// Registry of the trace rings, so that they can be dumped from a signal
+// handler without taking any lock.
+constexpr int MAX_TRACE_RINGS = 256;
+std::atomic<TraceRing*> g_trace_rings[MAX_TRACE_RINGS] = {};
+std::atomic<int> g_trace_ring_count = 0;
+
+std::uint64_t GetMonotonicNanoseconds() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return std::uint64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+// Gets the trace ring of the current thread, or null if there are already too
+// many threads.
+TraceRing* GetTraceRing() {
+  thread_local TraceRing* const ring = []() -> TraceRing* {
+    int const i = g_trace_ring_count.fetch_add(1, std::memory_order_relaxed);
+    if (i >= MAX_TRACE_RINGS) {
+      return nullptr;
+    }
+
+    TraceRing* const ring = new TraceRing{.thread_id = std::uint16_t(i)};
+    g_trace_rings[i].store(ring, std::memory_order_release);
+    return ring;
+  }();
+  return ring;
+}
+
+void AddTraceRecord(TraceEvent const event,
+                    std::uint64_t const timestamp,
+                    std::uint64_t const duration,
+                    int const reader_id,
+                    i64 const index_within_archive,
+                    i64 const offset_within_entry,
+                    i64 const length) {
+  TraceRing* const ring = GetTraceRing();
+  if (!ring) {
+    return;
+  }
+
+  std::uint64_t const head = ring->head.load(std::memory_order_relaxed);
+  ring->records[head % TraceRing::size] = {
+      .timestamp = timestamp,
+      .duration = duration,
+      .index_within_archive = index_within_archive,
+      .offset_within_entry = offset_within_entry,
+      .length = length,
+      .reader_id = static_cast<std::uint32_t>(reader_id),
+      .thread_id = ring->thread_id,
+      .event = event};
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+// Records an instantaneous event.
+#define TRACE(event, ...)                                                 \
+  if (g_trace)                                                            \
+  AddTraceRecord(TraceEvent::event, GetMonotonicNanoseconds(), 0, __VA_ARGS__)
+
+// Records an event spanning the lifetime of this object. The fields can be
+// updated before the end of the span.
+struct TraceSpan {
+  TraceEvent const event;
+  int reader_id = 0;
+  i64 index_within_archive = 0;
+  i64 offset_within_entry = 0;
+  i64 length = 0;
+  std::uint64_t const start = g_trace ? GetMonotonicNanoseconds() : 0;
+
+  ~TraceSpan() {
+    if (g_trace) {
+      AddTraceRecord(event, start, GetMonotonicNanoseconds() - start, reader_id,
+                     index_within_archive, offset_within_entry, length);
+    }
+  }
+};
+
+// Header of a trace dump file.
+struct TraceFileHeader {
+  char magic[8] = {'F', 'A', 'T', 'R', 'A', 'C', 'E', '1'};
+  std::uint32_t record_size = sizeof(TraceRecord);
+  std::uint32_t ring_size = TraceRing::size;
+};
+
+// Dumps the trace rings to the trace file. This function is async-signal-safe
+// if log_errors is false. Records being written while dumping might appear
+// torn.
+void DumpTraceRings(bool const log_errors = true) {
+  if (!g_options.trace) {
+    return;
+  }
+
+  int const fd = openat(g_trace_dir_fd, g_options.trace,
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    if (log_errors) {
+      PLOG(ERROR) << "Cannot create trace file " << Path(g_options.trace);
+    }
+    return;
+  }
+
+  auto const write_all = [fd](const void* p, size_t n) {
+    while (n > 0) {
+      ssize_t const k = write(fd, p, n);
+      if (k < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      p = static_cast<const char*>(p) + k;
+      n -= k;
+    }
+  };
+
+  TraceFileHeader const header;
+  write_all(&header, sizeof(header));
+
+  int const n = std::min(
+      g_trace_ring_count.load(std::memory_order_relaxed), MAX_TRACE_RINGS);
+  for (int i = 0; i < n; ++i) {
+    const TraceRing* const ring =
+        g_trace_rings[i].load(std::memory_order_acquire);
+    if (!ring) {
+      continue;
+    }
+
+    // Write the records from the oldest to the newest.
+    std::uint64_t const head = ring->head.load(std::memory_order_acquire);
+    std::uint64_t const count = std::min(head, TraceRing::size);
+    std::uint64_t const begin = (head - count) % TraceRing::size;
+    std::uint64_t const first = std::min(count, TraceRing::size - begin);
+    write_all(ring->records + begin, first * sizeof(TraceRecord));
+    write_all(ring->records, (count - first) * sizeof(TraceRecord));
+  }
+
+  close(fd);
+}
+
+void OnTraceSignal(int) {
+  int const e = errno;
+  DumpTraceRings(false);
+  errno = e;
+}
+
+// Enables tracing if requested by the "-o trace=FILE" option.
+void SetUpTracing() {
+  if (!g_options.trace) {
+    return;
+  }
+
+  g_trace = true;
+
+  if (g_options.trace[0] != '/') {
+    g_trace_dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (g_trace_dir_fd < 0) {
+      PLOG(ERROR) << "Cannot open current directory";
+      throw ExitCode::GENERIC_FAILURE;
+    }
+  }
+
+  struct sigaction sa = {};
+  sa.sa_handler = OnTraceSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR1, &sa, nullptr) < 0) {
+    PLOG(ERROR) << "Cannot install SIGUSR1 handler";
+  }
+
+  LOG(DEBUG) << "Tracing into " << Path(g_options.trace);
+}
+
+// ---- Mount Profiler
+
+// Phases of BuildTree. The time spent in each phase is exclusive: for example,
+// the time spent reading the archive file while parsing a header is accounted
+// to ARCHIVE_IO, not to HEADER_PARSING.
+enum class Phase : int {
+  OTHER,
+  ARCHIVE_IO,
+  DECOMPRESSION,
+  HEADER_PARSING,
+  TREE_BUILDING,
+  COLLISIONS,
+  HARDLINKS,
+  CACHE_WRITE,
+  COUNT,
+};
+
+std::string_view GetPhaseName(Phase const phase) {
+  switch (phase) {
+    case Phase::OTHER:
+      return "other";
+    case Phase::ARCHIVE_IO:
+      return "archive_io";
+    case Phase::DECOMPRESSION:
+      return "decompression";
+    case Phase::HEADER_PARSING:
+      return "header_parsing";
+    case Phase::TREE_BUILDING:
+      return "tree_building";
+    case Phase::COLLISIONS:
+      return "collisions";
+    case Phase::HARDLINKS:
+      return "hardlinks";
+    case Phase::CACHE_WRITE:
+      return "cache_write";
+    case Phase::COUNT:
+      break;
+  }
+
+  return "unknown";
+}
+
+struct PhaseStats {
+  i64 nanoseconds = 0;
+  // Number of bytes processed in this phase, if relevant.
+  i64 bytes = 0;
+  // Number of items (entries, nodes...) processed in this phase, if relevant.
+  i64 count = 0;
+};
+
+// Accumulates the time spent in each phase of BuildTree.
+class Profiler {
+ public:
+  // Starts profiling.
+  static void Start() {
+    active_ = true;
+    current_ = Phase::OTHER;
+    start_ = GetMonotonicNanoseconds();
+  }
+
+  // Stops profiling.
+  static void Stop() {
+    Switch(Phase::OTHER);
+    active_ = false;
+  }
+
+  // Switches to the given phase and returns the previous one.
+  static Phase Switch(Phase const phase) {
+    if (!active_) {
+      return phase;
+    }
+
+    std::uint64_t const now = GetMonotonicNanoseconds();
+    stats_[static_cast<int>(current_)].nanoseconds += now - start_;
+    start_ = now;
+    return std::exchange(current_, phase);
+  }
+
+  static void AddBytes(Phase const phase, i64 const bytes) {
+    if (active_) {
+      stats_[static_cast<int>(phase)].bytes += bytes;
+    }
+  }
+
+  static void AddCount(Phase const phase, i64 const count = 1) {
+    if (active_) {
+      stats_[static_cast<int>(phase)].count += count;
+    }
+  }
+
+  static const PhaseStats& Get(Phase const phase) {
+    return stats_[static_cast<int>(phase)];
+  }
+
+  // Logs the breakdown of the time spent in each phase, and writes it as JSON
+  // into the file named by "-o profile=FILE" if any.
+  static void Report(i64 total_nanoseconds);
+
+ private:
+  static bool active_;
+  static Phase current_;
+  static std::uint64_t start_;
+  static PhaseStats stats_[static_cast<int>(Phase::COUNT)];
+};
+
+bool Profiler::active_ = false;
+Phase Profiler::current_ = Phase::OTHER;
+std::uint64_t Profiler::start_ = 0;
+PhaseStats Profiler::stats_[static_cast<int>(Phase::COUNT)] = {};
+
+// Accounts the time spent during the lifetime of this object to the given
+// phase.
+class ScopedPhase {
+ public:
+  explicit ScopedPhase(Phase const phase)
+      : previous_(Profiler::Switch(phase)) {}
+  ScopedPhase(const ScopedPhase&) = delete;
+  ~ScopedPhase() { Profiler::Switch(previous_); }
+
+ private:
+  Phase const previous_;
+};
+
+// Converts bytes and nanoseconds into MB/s.
+double GetThroughput(i64 const bytes, i64 const nanoseconds) {
+  return nanoseconds > 0 ? 1e3 * bytes / nanoseconds : 0;
+}
+
+void Profiler::Report(i64 const total_nanoseconds) {
+  const PhaseStats& io = Get(Phase::ARCHIVE_IO);
+  const PhaseStats& decompression = Get(Phase::DECOMPRESSION);
+  const PhaseStats& cache_write = Get(Phase::CACHE_WRITE);
+
+  // Which phase takes the most time?
+  std::string_view bound = "cpu";
+  i64 const cpu_nanoseconds = total_nanoseconds - io.nanoseconds -
+                              cache_write.nanoseconds;
+  if (io.nanoseconds > cpu_nanoseconds &&
+      io.nanoseconds >= cache_write.nanoseconds) {
+    bound = "io";
+  } else if (cache_write.nanoseconds > cpu_nanoseconds) {
+    bound = "cache";
+  }
+
+  double const compressed_throughput =
+      GetThroughput(io.bytes, total_nanoseconds);
+  double const uncompressed_throughput =
+      GetThroughput(decompression.bytes, total_nanoseconds);
+
+  if (LOG_IS_ON(DEBUG)) {
+    for (int i = 0; i < static_cast<int>(Phase::COUNT); ++i) {
+      const PhaseStats& stats = stats_[i];
+      LOG(DEBUG) << "Phase " << GetPhaseName(Phase(i)) << ": "
+                 << stats.nanoseconds / 1'000'000 << " ms, " << stats.bytes
+                 << " bytes, " << stats.count << " items";
+    }
+
+    LOG(DEBUG) << "Throughput: " << std::fixed << std::setprecision(1)
+               << compressed_throughput << " MB/s compressed, "
+               << uncompressed_throughput << " MB/s uncompressed ("
+               << bound << "-bound)";
+  }
+
+  if (!g_options.profile) {
+    return;
+  }
+
+  std::ostringstream out;
+  out.imbue(std::locale::classic());
+  out << std::fixed << std::setprecision(3) << "{\n  \"total_ms\": "
+      << total_nanoseconds / 1e6 << ",\n  \"compressed_bytes\": " << io.bytes
+      << ",\n  \"uncompressed_bytes\": " << decompression.bytes
+      << ",\n  \"compressed_mb_per_s\": " << compressed_throughput
+      << ",\n  \"uncompressed_mb_per_s\": " << uncompressed_throughput
+      << ",\n  \"bound\": \"" << bound << "\",\n  \"phases\": {";
+  for (int i = 0; i < static_cast<int>(Phase::COUNT); ++i) {
+    const PhaseStats& stats = stats_[i];
+    out << (i ? "," : "") << "\n    \"" << GetPhaseName(Phase(i))
+        << "\": {\"ms\": " << stats.nanoseconds / 1e6
+        << ", \"bytes\": " << stats.bytes << ", \"count\": " << stats.count
+        << ", \"mb_per_s\": " << GetThroughput(stats.bytes, stats.nanoseconds)
+        << "}";
+  }
+  out << "\n  }\n}\n";
+
+  std::string const json = std::move(out).str();
+  int const fd = open(g_options.profile,
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    PLOG(ERROR) << "Cannot create profile file " << Path(g_options.profile);
+    return;
+  }
+
+  if (write(fd, json.data(), json.size()) != ssize_t(json.size())) {
+    PLOG(ERROR) << "Cannot write profile file " << Path(g_options.profile);
+  }
+
+  close(fd);
+}
+
 std::string GetCacheDir() {
   const char* const val = std::getenv("TMPDIR");
   return val && *val ? val : "/tmp";
@@ -1024,47 +1706,495 @@ const char* ReadPassword(Archive*, void*) {
   return g_password.c_str();
 }
 
-// ---- Side Buffer
+// ---- Resource Limits
 
-// Returns the index of the least recently used side buffer. This indexes
-// g_side_buffer_data and g_side_buffer_metadata.
-int AcquireSideBuffer() {
-  int oldest_i = 0;
-  i64 oldest_lru_priority = g_side_buffer_metadata[0].lru_priority;
-  for (int i = 1; i < NUM_SIDE_BUFFERS; i++) {
-    if (oldest_lru_priority > g_side_buffer_metadata[i].lru_priority) {
-      oldest_lru_priority = g_side_buffer_metadata[i].lru_priority;
-      oldest_i = i;
-    }
+// The limits set by the "-o max..." options protect the host against hostile or
+// broken archives, such as decompression bombs. They are checked while loading
+// the archive, which stops as soon as one of them is exceeded.
+
+// Time at which loading the archive must be stopped.
+std::chrono::steady_clock::time_point g_load_deadline =
+    std::chrono::steady_clock::time_point::max();
+
+// Total size of the files loaded so far. In cache mode, this doesn't count the
+// alignment holes of the cache file.
+i64 g_loaded_size = 0;
+
+void CheckEntryCount(i64 const count) {
+  if (g_options.max_entries && count > g_options.max_entries) {
+    LOG(ERROR) << "The archive has more than " << g_options.max_entries
+               << " entries";
+    throw ExitCode::LIMIT_EXCEEDED;
   }
-  g_side_buffer_metadata[oldest_i].index_within_archive = -1;
-  g_side_buffer_metadata[oldest_i].offset_within_entry = -1;
-  g_side_buffer_metadata[oldest_i].length = -1;
-  g_side_buffer_metadata[oldest_i].lru_priority = UINT64_MAX;
-  return oldest_i;
 }
 
-bool ReadFromSideBuffer(i64 const index_within_archive,
-                        char* const dst_ptr,
-                        size_t const dst_len,
-                        i64 const offset_within_entry) {
-  // Find the longest side buffer that contains (index_within_archive,
-  // offset_within_entry, dst_len).
-  int best_i = -1;
-  i64 best_length = -1;
-  for (int i = 0; i < NUM_SIDE_BUFFERS; i++) {
-    const SideBufferMetadata& meta = g_side_buffer_metadata[i];
-    if (meta.length > best_length &&
-        meta.Contains(index_within_archive, offset_within_entry, dst_len)) {
-      best_i = i;
-      best_length = meta.length;
-    }
+void CheckPathDepth(std::string_view const path) {
+  if (g_options.max_depth &&
+      std::count(path.begin(), path.end(), '/') > g_options.max_depth) {
+    LOG(ERROR) << "The path " << Path(path) << " has more than "
+               << g_options.max_depth << " components";
+    throw ExitCode::LIMIT_EXCEEDED;
   }
+}
 
-  if (best_i >= 0) {
-    SideBufferMetadata& meta = g_side_buffer_metadata[best_i];
-    meta.lru_priority = ++SideBufferMetadata::next_lru_priority;
-    i64 const o = offset_within_entry - meta.offset_within_entry;
+void CheckTotalSize(i64 const size) {
+  if (g_options.max_size && size > g_options.max_size) {
+    LOG(ERROR) << "The files take more than " << g_options.max_size
+               << " bytes";
+    throw ExitCode::LIMIT_EXCEEDED;
+  }
+}
+
+// Checks the expansion ratio of an entry being decompressed. The compressed
+// size is only known to within a few reads of the archive file, so small
+// entries can get a larger ratio.
+void CheckExpansionRatio(i64 const size, i64 const compressed_size) {
+  constexpr i64 slack = 64 << 10;
+  if (g_options.max_ratio &&
+      double(size) > double(g_options.max_ratio) * (compressed_size + slack)) {
+    LOG(ERROR) << "The expansion ratio of a file exceeds "
+               << g_options.max_ratio << ": " << size << " bytes from about "
+               << compressed_size << " bytes";
+    throw ExitCode::LIMIT_EXCEEDED;
+  }
+}
+
+void CheckLoadTime() {
+  if (std::chrono::steady_clock::now() > g_load_deadline) {
+    LOG(ERROR) << "Loading the archive takes more than " << g_options.max_time
+               << " seconds";
+    throw ExitCode::LIMIT_EXCEEDED;
+  }
+}
+
+// ---- Access Patterns
+
+// In nocache mode, each file handle classifies the pattern of its read requests,
+// and adapts the way it decompresses the data to this pattern.
+enum class AccessPattern : std::uint8_t {
+  Unknown,
+  // Each read starts where the previous one ended.
+  Sequential,
+  // Reads skip forward by a constant amount.
+  Strided,
+  // Reads mostly jump backwards.
+  Backward,
+  // Reads jump in all directions.
+  Random,
+};
+
+std::ostream& operator<<(std::ostream& out, AccessPattern const p) {
+  switch (p) {
+#define PRINT(s)         \
+  case AccessPattern::s: \
+    return out << #s;
+    PRINT(Unknown)
+    PRINT(Sequential)
+    PRINT(Strided)
+    PRINT(Backward)
+    PRINT(Random)
+#undef PRINT
+  }
+
+  return out << "AccessPattern(" << int(p) << ")";
+}
+
+// Classifies the recent read requests of a file handle.
+class AccessClassifier {
+ public:
+  // Takes a read request into account, and returns the updated pattern.
+  AccessPattern Update(i64 const offset, i64 const size) {
+    i64 const jump = offset - next_offset_;
+    Move const move = jump == 0                ? Move::Sequential
+                      : jump < 0               ? Move::Backward
+                      : jump == previous_jump_ ? Move::Strided
+                                               : Move::Forward;
+    next_offset_ = offset + size;
+    previous_jump_ = jump;
+
+    moves_[position_] = move;
+    position_ = (position_ + 1) % kWindow;
+    if (count_ < kWindow) {
+      ++count_;
+    }
+
+    if (count_ < kMinMoves) {
+      return AccessPattern::Unknown;
+    }
+
+    int counts[4] = {};
+    int const n = count_;
+    for (int i = 0; i < n; ++i) {
+      counts[static_cast<int>(moves_[i])]++;
+    }
+
+    if (4 * counts[int(Move::Sequential)] >= 3 * n) {
+      return AccessPattern::Sequential;
+    }
+
+    if (2 * counts[int(Move::Strided)] >= n) {
+      return AccessPattern::Strided;
+    }
+
+    if (4 * counts[int(Move::Backward)] >= 3 * n) {
+      return AccessPattern::Backward;
+    }
+
+    return AccessPattern::Random;
+  }
+
+ private:
+  enum class Move : std::uint8_t { Sequential, Strided, Forward, Backward };
+
+  // Number of reads needed before classifying.
+  static constexpr int kMinMoves = 4;
+  // Number of recent reads taken into account.
+  static constexpr int kWindow = 16;
+
+  i64 next_offset_ = 0;
+  i64 previous_jump_ = 0;
+  // Number of moves in the window, up to kWindow.
+  int count_ = 0;
+  // Position of the next move in the window.
+  int position_ = 0;
+  Move moves_[kWindow] = {};
+};
+
+// Numbers of file handles that switched to each access pattern.
+i64 g_pattern_switches[int(AccessPattern::Random) + 1] = {};
+
+// Number of entries decompressed whole in memory for random access.
+i64 g_entry_copies_made = 0;
+
+// ---- Decompression Statistics
+
+// In nocache mode, serving a read request can require decompressing much more
+// data than what is returned to the client. These statistics account, for each
+// archive entry, where the decompressed bytes went.
+struct EntryStats {
+  // Node of the entry, if known.
+  const Node* node = nullptr;
+  // Number of bytes of other entries decompressed while walking to this entry.
+  i64 walked = 0;
+  // Number of bytes of this entry decompressed and discarded while skipping to
+  // the requested offset.
+  i64 skipped = 0;
+  // Number of bytes of this entry decompressed to serve read requests.
+  i64 read = 0;
+  // Number of bytes returned to the clients, including side buffer hits.
+  i64 served = 0;
+  // Number of Readers created from the start of the archive for this entry.
+  i64 restarts = 0;
+  // Number of bytes served from the handles' buffers.
+  i64 buffered = 0;
+  // Number of times decompressing this entry failed.
+  i64 failures = 0;
+  // Latest access pattern of the handles reading this entry.
+  AccessPattern pattern = AccessPattern::Unknown;
+
+  i64 GetDecompressed() const { return walked + skipped + read; }
+
+  // Wasted bytes are the bytes decompressed but not returned to clients.
+  i64 GetWasted() const { return std::max<i64>(GetDecompressed() - served, 0); }
+};
+
+// Statistics indexed by index_within_archive.
+std::unordered_map<i64, EntryStats> g_entry_stats;
+
+// Has a report been requested by SIGUSR2?
+std::atomic<bool> g_stats_requested = false;
+
+void OnStatsSignal(int) {
+  g_stats_requested.store(true, std::memory_order_relaxed);
+}
+
+// Logs the overall decompression efficiency and the worst entries.
+void ReportStats() {
+  if (g_entry_stats.empty()) {
+    LOG(INFO) << "No decompression statistics";
+    return;
+  }
+
+  EntryStats total;
+  std::vector<std::pair<i64, const EntryStats*>> entries;
+  entries.reserve(g_entry_stats.size());
+  for (const auto& [index, stats] : g_entry_stats) {
+    total.walked += stats.walked;
+    total.skipped += stats.skipped;
+    total.read += stats.read;
+    total.served += stats.served;
+    total.restarts += stats.restarts;
+    total.buffered += stats.buffered;
+    total.failures += stats.failures;
+    entries.emplace_back(index, &stats);
+  }
+
+  auto const ratio = [](const EntryStats& stats) {
+    return stats.served > 0 ? double(stats.GetDecompressed()) / stats.served
+                            : 0.0;
+  };
+
+  LOG(INFO) << "Decompressed " << total.GetDecompressed() << " bytes ("
+            << total.walked << " walked, " << total.skipped << " skipped, "
+            << total.read << " read) to serve " << total.served
+            << " bytes: ratio " << std::fixed << std::setprecision(1)
+            << ratio(total) << " with " << total.restarts << " restarts and "
+            << total.failures << " failures";
+
+  std::ostringstream switches;
+  for (int i = 1; i <= int(AccessPattern::Random); ++i) {
+    switches << (i > 1 ? ", " : "") << g_pattern_switches[i] << " "
+             << AccessPattern(i);
+  }
+
+  LOG(INFO) << "Served " << total.buffered
+            << " bytes from file handle buffers and " << g_entry_copies_made
+            << " entry copies, with handles switching to " << switches.str();
+
+  constexpr size_t max_reported = 10;
+  size_t const n = std::min(entries.size(), max_reported);
+  std::partial_sort(entries.begin(), entries.begin() + n, entries.end(),
+                    [](auto const& a, auto const& b) {
+                      return a.second->GetWasted() > b.second->GetWasted();
+                    });
+
+  for (size_t i = 0; i < n; ++i) {
+    auto const& [index, stats] = entries[i];
+    if (stats->GetWasted() == 0) {
+      break;
+    }
+
+    LOG(INFO) << "Entry [" << index << "] "
+              << (stats->node ? Path(stats->node->GetPath()) : Path("?"))
+              << ": wasted " << stats->GetWasted() << " bytes ("
+              << stats->walked << " walked, " << stats->skipped << " skipped, "
+              << stats->read << " read) to serve " << stats->served
+              << " bytes: ratio " << std::fixed << std::setprecision(1)
+              << ratio(*stats) << " with " << stats->restarts << " restarts, "
+              << stats->failures << " failures and " << stats->pattern
+              << " access";
+  }
+}
+
+// Reports the statistics if they have been requested by SIGUSR2.
+void ReportStatsIfRequested() {
+  if (g_stats_requested.load(std::memory_order_relaxed) &&
+      g_stats_requested.exchange(false)) {
+    ReportStats();
+  }
+}
+
+void SetUpStats() {
+  struct sigaction sa = {};
+  sa.sa_handler = OnStatsSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR2, &sa, nullptr) < 0) {
+    PLOG(ERROR) << "Cannot install SIGUSR2 handler";
+  }
+}
+
+// ---- Read Failures
+
+// In nocache mode, reading a corrupted or undecryptable entry decompresses it
+// up to the point of failure. The failures are remembered, so that the reads
+// reaching the same point fail immediately instead of decompressing the entry
+// again. They are forgotten when reading the "user.archive.retry" extended
+// attribute of the root directory.
+struct ReadFailure {
+  // Position in the entry's decompressed contents at which reading failed.
+  i64 offset;
+  // Error that caused the failure.
+  ExitCode error;
+};
+
+// Failures indexed by index_within_archive.
+std::unordered_map<i64, ReadFailure> g_read_failures;
+
+// Forgets the failures, so that the next reads try again.
+void ForgetFailures() {
+  LOG(INFO) << "Forgetting " << g_read_failures.size() << " failed entries";
+  g_read_failures.clear();
+}
+
+// Remembers that reading the given entry failed at the given offset.
+void RecordFailure(i64 const index_within_archive,
+                   i64 const offset,
+                   ExitCode const error) {
+  g_entry_stats[index_within_archive].failures++;
+  auto const [it, inserted] =
+      g_read_failures.try_emplace(index_within_archive, offset, error);
+  if (!inserted && offset < it->second.offset) {
+    it->second = {offset, error};
+  }
+}
+
+// Gets the failure preventing the given range of the given entry from being
+// read, or null.
+const ReadFailure* FindFailure(i64 const index_within_archive,
+                               i64 const offset,
+                               i64 const size) {
+  auto const it = g_read_failures.find(index_within_archive);
+  return it != g_read_failures.end() && it->second.offset < offset + size
+             ? &it->second
+             : nullptr;
+}
+
+// Can the given archive skip entries without decompressing them?
+bool CanSkipWithoutDecompressing(Archive* const a) {
+  switch (archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) {
+    case ARCHIVE_FORMAT_ZIP:
+    case ARCHIVE_FORMAT_ISO9660:
+      return true;
+
+    case ARCHIVE_FORMAT_TAR:
+    case ARCHIVE_FORMAT_CPIO:
+      for (int i = archive_filter_count(a); i > 0;) {
+        if (archive_filter_code(a, --i) != ARCHIVE_FILTER_NONE) {
+          return false;
+        }
+      }
+      return true;
+  }
+
+  return false;
+}
+
+// ---- Slow Storage Emulation
+
+// For benchmarking only. The environment variable FUSE_ARCHIVE_SLOW_IO makes
+// the archive reads behave as if the archive was on slow storage, e.g.
+// "latency=8000,jitter=4000,bandwidth=100000000" for a HDD. The latency and
+// jitter are in microseconds, and the bandwidth is in bytes per second.
+//
+// The bandwidth is shared by all the readers, like it would be by a single
+// device. Each read then waits for the latency plus a random jitter.
+
+struct SlowIo {
+  i64 latency_ns = 0;
+  i64 jitter_ns = 0;
+  i64 bytes_per_second = 0;
+
+  // Time at which the emulated device becomes idle.
+  std::atomic<std::uint64_t> idle_at = 0;
+};
+
+SlowIo g_slow_io;
+bool g_slow_io_enabled = false;
+
+void SetUpSlowIo() {
+  const char* const val = std::getenv("FUSE_ARCHIVE_SLOW_IO");
+  if (!val || !*val) {
+    return;
+  }
+
+  std::string_view spec = val;
+  while (!spec.empty()) {
+    std::string_view item = spec.substr(0, spec.find(','));
+    spec.remove_prefix(std::min(item.size() + 1, spec.size()));
+
+    size_t const eq = item.find('=');
+    std::string_view const key = item.substr(0, eq);
+    char* end = nullptr;
+    i64 const value =
+        eq == item.npos ? -1 : std::strtoll(item.data() + eq + 1, &end, 10);
+    if (value < 0 || end != item.data() + item.size()) {
+      LOG(ERROR) << "Invalid FUSE_ARCHIVE_SLOW_IO item '" << item << "'";
+      throw ExitCode::GENERIC_FAILURE;
+    }
+
+    if (key == "latency") {
+      g_slow_io.latency_ns = value * 1000;
+    } else if (key == "jitter") {
+      g_slow_io.jitter_ns = value * 1000;
+    } else if (key == "bandwidth") {
+      g_slow_io.bytes_per_second = value;
+    } else {
+      LOG(ERROR) << "Unknown FUSE_ARCHIVE_SLOW_IO key '" << key << "'";
+      throw ExitCode::GENERIC_FAILURE;
+    }
+  }
+
+  g_slow_io_enabled = true;
+  LOG(INFO) << "Emulating slow storage: latency "
+            << g_slow_io.latency_ns / 1000 << " us, jitter "
+            << g_slow_io.jitter_ns / 1000 << " us, bandwidth "
+            << g_slow_io.bytes_per_second << " bytes/s";
+}
+
+// Waits for as long as the emulated storage would take to read n bytes.
+void WaitForSlowIo(i64 const n) {
+  std::uint64_t const now = GetMonotonicNanoseconds();
+  std::uint64_t done = now;
+
+  // Occupy the emulated device for the transfer time.
+  if (g_slow_io.bytes_per_second > 0) {
+    std::uint64_t const transfer = n * 1'000'000'000 /
+                                   g_slow_io.bytes_per_second;
+    std::uint64_t idle_at = g_slow_io.idle_at.load(std::memory_order_relaxed);
+    do {
+      done = std::max(idle_at, now) + transfer;
+    } while (!g_slow_io.idle_at.compare_exchange_weak(
+        idle_at, done, std::memory_order_relaxed));
+  }
+
+  done += g_slow_io.latency_ns;
+  if (g_slow_io.jitter_ns > 0) {
+    thread_local std::uint64_t state = GetMonotonicNanoseconds() | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    done += state % g_slow_io.jitter_ns;
+  }
+
+  timespec const ts = {.tv_sec = static_cast<time_t>(done / 1'000'000'000),
+                       .tv_nsec = static_cast<long>(done % 1'000'000'000)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) ==
+         EINTR) {
+  }
+}
+
+// ---- Side Buffer
+
+// Returns the index of the least recently used side buffer. This indexes
+// g_side_buffer_data and g_side_buffer_metadata.
+int AcquireSideBuffer() {
+  int oldest_i = 0;
+  i64 oldest_lru_priority = g_side_buffer_metadata[0].lru_priority;
+  for (int i = 1; i < NUM_SIDE_BUFFERS; i++) {
+    if (oldest_lru_priority > g_side_buffer_metadata[i].lru_priority) {
+      oldest_lru_priority = g_side_buffer_metadata[i].lru_priority;
+      oldest_i = i;
+    }
+  }
+  g_side_buffer_metadata[oldest_i].index_within_archive = -1;
+  g_side_buffer_metadata[oldest_i].offset_within_entry = -1;
+  g_side_buffer_metadata[oldest_i].length = -1;
+  g_side_buffer_metadata[oldest_i].lru_priority = UINT64_MAX;
+  return oldest_i;
+}
+
+bool ReadFromSideBuffer(i64 const index_within_archive,
+                        char* const dst_ptr,
+                        size_t const dst_len,
+                        i64 const offset_within_entry) {
+  // Find the longest side buffer that contains (index_within_archive,
+  // offset_within_entry, dst_len).
+  int best_i = -1;
+  i64 best_length = -1;
+  for (int i = 0; i < NUM_SIDE_BUFFERS; i++) {
+    const SideBufferMetadata& meta = g_side_buffer_metadata[i];
+    if (meta.length > best_length &&
+        meta.Contains(index_within_archive, offset_within_entry, dst_len)) {
+      best_i = i;
+      best_length = meta.length;
+    }
+  }
+
+  if (best_i >= 0) {
+    SideBufferMetadata& meta = g_side_buffer_metadata[best_i];
+    meta.lru_priority = ++SideBufferMetadata::next_lru_priority;
+    i64 const o = offset_within_entry - meta.offset_within_entry;
     memcpy(dst_ptr, g_side_buffer_data[best_i] + o, dst_len);
     return true;
   }
@@ -1072,6 +2202,74 @@ bool ReadFromSideBuffer(i64 const index_within_archive,
   return false;
 }
 
+// ---- Input Buffers
+
+// Smallest and biggest sizes of the reads from the archive file. A Reader
+// starts with reads of the smallest size, doubles it after a few sequential
+// reads up to "-o readsize", and goes back to it after jumping to another
+// position.
+constexpr i64 kMinReadSize = 16 << 10;
+constexpr i64 kMaxReadSize = 64 << 20;
+
+// Number of consecutive sequential reads before the reads get bigger. Small
+// entries then don't get over-read after each jump to their headers.
+constexpr int kSequentialReadsBeforeGrowing = 4;
+
+// Input buffers of the Readers, kept for reuse. The buffer sizes are powers of
+// two. Several threads can create Readers in --extract mode.
+// None of these functions throws, since they are called from libarchive.
+class BufferPool {
+ public:
+  using Buffer = std::unique_ptr<std::byte[]>;
+
+  // Gets a buffer of the given size, or null if it cannot be allocated.
+  static Buffer Get(i64 const size) noexcept {
+    {
+      std::lock_guard const lock(mutex_);
+      FreeList& f = free_[GetSizeClass(size)];
+      if (f.count > 0) {
+        return std::move(f.buffers[--f.count]);
+      }
+    }
+
+    return Buffer(new (std::nothrow) std::byte[size]);
+  }
+
+  // Gives back a buffer of the given size.
+  static void Put(Buffer b, i64 const size) noexcept {
+    if (!b) {
+      return;
+    }
+
+    std::lock_guard const lock(mutex_);
+    FreeList& f = free_[GetSizeClass(size)];
+    if (f.count < kMaxFreeBuffers) {
+      f.buffers[f.count++] = std::move(b);
+    }
+  }
+
+ private:
+  static int GetSizeClass(i64 const size) {
+    assert(size > 0);
+    assert(std::has_single_bit(static_cast<std::uint64_t>(size)));
+    return std::countr_zero(static_cast<std::uint64_t>(size));
+  }
+
+  // Maximum number of buffers of each size kept for reuse.
+  static constexpr int kMaxFreeBuffers = 16;
+
+  // Zero-initialized, as a static member.
+  struct FreeList {
+    Buffer buffers[kMaxFreeBuffers];
+    int count;
+  };
+
+  static inline std::mutex mutex_;
+  static inline FreeList free_[64];
+};
+
+// ---- Reader
+
 // A Reader bundles libarchive concepts (an archive and an archive entry) and
 // other state to point to a particular offset (in decompressed space) of a
 // particular archive entry (identified by its index) in an archive.
@@ -1079,8 +2277,9 @@ bool ReadFromSideBuffer(i64 const index_within_archive,
 // A Reader is backed by its own archive_read_open call so each can be
 // positioned independently.
 struct Reader : bi::list_base_hook<LinkMode> {
-  // Number of Readers created so far.
-  static int count;
+  // Number of Readers created so far. Several threads can create Readers in
+  // --extract mode.
+  static std::atomic<int> count;
 
   int id = ++count;
   ArchivePtr archive = ArchivePtr(archive_read_new());
@@ -1089,9 +2288,29 @@ struct Reader : bi::list_base_hook<LinkMode> {
   i64 offset_within_entry = 0;
   bool should_print_progress = false;
   i64 pos = 0;
-  std::byte bytes[16 * 1024];
 
-  ~Reader() { LOG(DEBUG) << "Deleted " << *this; }
+  // Input buffer from BufferPool, position in the archive file where the
+  // latest read ended, and number of consecutive sequential reads.
+  BufferPool::Buffer buffer;
+  i64 buffer_size = 0;
+  i64 read_end = -1;
+  int sequential_reads = 0;
+
+  // Data of the latest block returned by archive_read_data_block that hasn't
+  // been consumed yet. This is a view into libarchive's buffer, which stays
+  // valid until the next call to libarchive. It starts at block_offset within
+  // the entry. If block_offset is past offset_within_entry, the bytes in
+  // between are a hole of a sparse entry.
+  std::span<const std::byte> block;
+  i64 block_offset = 0;
+  bool block_eof = false;
+
+  ~Reader() {
+    BufferPool::Put(std::move(buffer), buffer_size);
+    TRACE(READER_DELETE, id, index_within_archive, offset_within_entry, 0);
+    PROBE(reader__delete, id, index_within_archive, offset_within_entry);
+    LOG(DEBUG) << "Deleted " << *this;
+  }
 
   Reader() {
     if (!archive) {
@@ -1151,6 +2370,8 @@ struct Reader : bi::list_base_hook<LinkMode> {
     // Open the archive.
     Check(archive_read_open1(archive.get()));
 
+    TRACE(READER_CREATE, id, 0, 0, 0);
+    PROBE(reader__create, id);
     LOG(DEBUG) << "Created " << *this;
   }
 
@@ -1160,7 +2381,12 @@ struct Reader : bi::list_base_hook<LinkMode> {
 
   Entry* NextEntry() {
     offset_within_entry = 0;
+    block = {};
+    block_offset = 0;
+    block_eof = false;
     index_within_archive++;
+    ScopedPhase const phase(Phase::HEADER_PARSING);
+    Profiler::AddCount(Phase::HEADER_PARSING);
     while (true) {
       switch (archive_read_next_header(archive.get(), &entry)) {
         case ARCHIVE_RETRY:
@@ -1198,8 +2424,22 @@ struct Reader : bi::list_base_hook<LinkMode> {
 
     assert(index_within_archive < want);
     Timer const timer;
+    TraceSpan const span = {.event = TraceEvent::ADVANCE_INDEX,
+                            .reader_id = id,
+                            .index_within_archive = want,
+                            .length = want - index_within_archive};
+    PROBE(advance__index__start, id, index_within_archive, want);
+
+    // Account the bytes of the entries walked past.
+    i64 walked = 0;
+    bool const cheap_skip = CanSkipWithoutDecompressing(archive.get());
 
     do {
+      if (entry && !cheap_skip && archive_entry_size_is_set(entry)) {
+        walked += std::max<i64>(archive_entry_size(entry) - offset_within_entry,
+                                0);
+      }
+
       if (!NextEntry()) {
         LOG(ERROR) << "Reached EOF while advancing to entry "
                    << index_within_archive;
@@ -1208,6 +2448,10 @@ struct Reader : bi::list_base_hook<LinkMode> {
     } while (index_within_archive < want);
 
     assert(index_within_archive == want);
+    if (!g_cache) {
+      g_entry_stats[want].walked += walked;
+    }
+    PROBE(advance__index__end, id, want, span.length);
     LOG(DEBUG) << "Advanced " << *this << " to entry " << want << " in "
                << timer;
   }
@@ -1224,43 +2468,52 @@ struct Reader : bi::list_base_hook<LinkMode> {
     assert(offset_within_entry < want);
 
     Timer const timer;
+    TraceSpan const span = {.event = TraceEvent::ADVANCE_OFFSET,
+                            .reader_id = id,
+                            .index_within_archive = index_within_archive,
+                            .offset_within_entry = want,
+                            .length = want - offset_within_entry};
+    PROBE(advance__offset__start, id, index_within_archive, offset_within_entry,
+          want);
+
+    // We are behind where we want to be. Walk past the decompressed data
+    // without copying it, except for the last bytes before the wanted offset.
+    // Keep these in a side buffer, since the next requests will probably want
+    // them.
+    i64 const keep_from =
+        std::max(offset_within_entry, want - SIDE_BUFFER_SIZE);
+    {
+      ScopedPhase const phase(Phase::DECOMPRESSION);
+      while (offset_within_entry < keep_from) {
+        i64 const n = NextBlock(keep_from - offset_within_entry).size();
+        if (n == 0) {
+          break;
+        }
+
+        Profiler::AddBytes(Phase::DECOMPRESSION, n);
+      }
+    }
 
-    // We are behind where we want to be. Advance (decompressing from the
-    // archive entry into a side buffer) until we get there.
     int const sb = AcquireSideBuffer();
     assert(0 <= sb && sb < NUM_SIDE_BUFFERS);
-
-    uint8_t* const dst_ptr = g_side_buffer_data[sb];
     SideBufferMetadata& meta = g_side_buffer_metadata[sb];
     meta.lru_priority = ++SideBufferMetadata::next_lru_priority;
     meta.index_within_archive = index_within_archive;
-
-    do {
-      meta.offset_within_entry = offset_within_entry;
-      i64 dst_len = want - offset_within_entry;
-      assert(dst_len > 0);
-      // If the amount we need to advance is greater than the SIDE_BUFFER_SIZE,
-      // we need multiple Read calls, but the total advance might not be an
-      // exact multiple of SIDE_BUFFER_SIZE. Read that remainder amount first,
-      // not last. For example, if advancing 260KiB with a 128KiB
-      // SIDE_BUFFER_SIZE then read 4+128+128 instead of 128+128+4. This leaves
-      // a full side buffer when we've finished advancing, maximizing later
-      // requests' chances of side-buffer-as-cache hits.
-      if (dst_len > SIDE_BUFFER_SIZE) {
-        dst_len %= SIDE_BUFFER_SIZE;
-        if (dst_len == 0) {
-          dst_len = SIDE_BUFFER_SIZE;
-        }
-      }
-
-      meta.length = 0;
-      ssize_t const n = Read(dst_ptr, dst_len);
-      assert(n >= 0);
-
-      meta.length = n;
-    } while (offset_within_entry < want);
+    meta.offset_within_entry = offset_within_entry;
+    meta.length = Read(g_side_buffer_data[sb], want - offset_within_entry);
+
+    if (offset_within_entry < want) {
+      LOG(ERROR) << "Reached the end of entry " << index_within_archive
+                 << " at offset " << offset_within_entry
+                 << " while advancing to offset " << want;
+      throw ExitCode::INVALID_ARCHIVE_CONTENTS;
+    }
 
     assert(offset_within_entry == want);
+    if (!g_cache) {
+      g_entry_stats[index_within_archive].skipped += span.length;
+    }
+    PROBE(advance__offset__end, id, index_within_archive, want, span.length);
     LOG(DEBUG) << "Advanced " << *this << " to offset " << offset_within_entry
                << " in " << timer;
   }
@@ -1275,7 +2528,16 @@ struct Reader : bi::list_base_hook<LinkMode> {
       return archive_entry_size(entry);
     }
 
-    // Consume the entry's data.
+    if (block_eof) {
+      offset_within_entry = std::max(offset_within_entry, block_offset);
+      return offset_within_entry;
+    }
+
+    // Consume the entry's data, and check the limits as it gets decompressed.
+    block = {};
+    block_eof = true;
+    i64 const archive_start_offset = archive_filter_bytes(archive.get(), -1);
+    ScopedPhase const phase(Phase::DECOMPRESSION);
     for (off_t offset = offset_within_entry;;) {
       const void* buff = nullptr;
       size_t len = 0;
@@ -1289,8 +2551,13 @@ struct Reader : bi::list_base_hook<LinkMode> {
           [[fallthrough]];
 
         case ARCHIVE_OK:
+          Profiler::AddBytes(Phase::DECOMPRESSION, len);
           offset += len;
           offset_within_entry = offset;
+          CheckTotalSize(g_loaded_size + offset);
+          CheckExpansionRatio(offset, archive_filter_bytes(archive.get(), -1) -
+                                          archive_start_offset);
+          CheckLoadTime();
           continue;
 
         case ARCHIVE_EOF:
@@ -1302,6 +2569,7 @@ struct Reader : bi::list_base_hook<LinkMode> {
             offset_within_entry = offset;
           }
 
+          block_offset = offset_within_entry;
           if (archive_entry_is_encrypted(entry)) {
             g_password_checked = true;
           }
@@ -1328,34 +2596,56 @@ struct Reader : bi::list_base_hook<LinkMode> {
     g_password_checked = Read(buffer, sizeof(buffer)) > 0;
   }
 
+  // Gets a view of the next decompressed bytes of the entry, and advances the
+  // Reader's offset_within_entry past them. The view holds at most max_len
+  // bytes, and it is empty at the end of the entry. It is only valid until the
+  // next call to libarchive. The holes of sparse entries are viewed as zeros.
+  std::span<const std::byte> NextBlock(i64 const max_len) {
+    assert(max_len > 0);
+    while (block.empty() && block_offset <= offset_within_entry &&
+           !block_eof) {
+      FetchBlock();
+    }
+
+    std::span<const std::byte> view;
+    if (block_offset > offset_within_entry) {
+      static std::byte const zeros[64 * 1024] = {};
+      view = std::span(zeros).first(std::min<i64>(
+          {max_len, block_offset - offset_within_entry, sizeof(zeros)}));
+    } else {
+      assert(block_offset == offset_within_entry);
+      view = block.first(std::min<i64>(max_len, block.size()));
+      block = block.subspan(view.size());
+      block_offset += view.size();
+    }
+
+    offset_within_entry += view.size();
+    return view;
+  }
+
   // Copies from the archive entry's decompressed contents to the destination
   // buffer. It also advances the Reader's offset_within_entry.
   ssize_t Read(void* dst_ptr, size_t dst_len) {
+    TraceSpan span = {.event = TraceEvent::READER_READ,
+                      .reader_id = id,
+                      .index_within_archive = index_within_archive,
+                      .offset_within_entry = offset_within_entry};
+    ScopedPhase const phase(Phase::DECOMPRESSION);
     ssize_t total = 0;
     while (dst_len > 0) {
-      ssize_t const n = archive_read_data(archive.get(), dst_ptr, dst_len);
-      if (n == 0) {
+      std::span<const std::byte> const b = NextBlock(dst_len);
+      if (b.empty()) {
         break;
       }
 
-      if (n < 0) {
-        if (n == ARCHIVE_RETRY) {
-          continue;
-        }
-
-        std::string_view const error = GetErrorString(archive.get());
-        LOG(ERROR) << "Cannot read data from archive: " << error;
-        ThrowExitCode(error);
-      }
-
-      assert(n > 0);
-      assert(n <= dst_len);
-      dst_len -= n;
-      dst_ptr = static_cast<std::byte*>(dst_ptr) + n;
-      offset_within_entry += n;
-      total += n;
+      std::memcpy(dst_ptr, b.data(), b.size());
+      dst_len -= b.size();
+      dst_ptr = static_cast<std::byte*>(dst_ptr) + b.size();
+      total += b.size();
     }
 
+    span.length = total;
+    Profiler::AddBytes(Phase::DECOMPRESSION, total);
     return total;
   }
 
@@ -1400,20 +2690,36 @@ struct Reader : bi::list_base_hook<LinkMode> {
     if (best) {
       r.reset(best);
       recycled.erase(recycled.iterator_to(*best));
+      TRACE(READER_REUSE, r->id, r->index_within_archive,
+            r->offset_within_entry, 0);
       LOG(DEBUG) << "Reusing " << *r << " currently at offset "
                  << r->offset_within_entry << " of entry "
                  << r->index_within_archive;
     } else {
       r.reset(new Reader());
+      if (!g_cache) {
+        g_entry_stats[want_index_within_archive].restarts++;
+      }
     }
 
     assert(r);
-    r->AdvanceIndex(want_index_within_archive);
-    r->AdvanceOffset(want_offset_within_entry);
+    try {
+      r->AdvanceIndex(want_index_within_archive);
+      r->AdvanceOffset(want_offset_within_entry);
+    } catch (...) {
+      // Don't recycle a Reader in an unknown state.
+      delete r.release();
+      throw;
+    }
 
     return r;
   }
 
+  // Deletes all the recycled Readers.
+  static void DeleteRecycled() {
+    recycled.clear_and_dispose(std::default_delete<Reader>());
+  }
+
  private:
   void Check(int const status) const {
     if (status != ARCHIVE_OK) {
@@ -1423,18 +2729,94 @@ struct Reader : bi::list_base_hook<LinkMode> {
     }
   }
 
+  // Gets the next data block of the entry from libarchive.
+  void FetchBlock() {
+    while (true) {
+      const void* buff = nullptr;
+      size_t len = 0;
+      off_t offset = 0;
+
+      switch (archive_read_data_block(archive.get(), &buff, &len, &offset)) {
+        case ARCHIVE_RETRY:
+          continue;
+
+        case ARCHIVE_WARN:
+          LOG(WARNING) << GetErrorString(archive.get());
+          [[fallthrough]];
+
+        case ARCHIVE_OK:
+          block = {static_cast<const std::byte*>(buff), len};
+          block_offset = offset;
+          if (block_offset < offset_within_entry) {
+            // Drop the part of the block that overlaps the consumed data.
+            i64 const n =
+                std::min<i64>(offset_within_entry - block_offset, len);
+            block = block.subspan(n);
+            block_offset += n;
+          }
+          return;
+
+        case ARCHIVE_EOF:
+          // There might be a final hole up to the end of the entry.
+          block = {};
+          block_offset = std::max<i64>(offset, offset_within_entry);
+          block_eof = true;
+          return;
+
+        case ARCHIVE_FAILED:
+        case ARCHIVE_FATAL:
+          std::string_view const error = GetErrorString(archive.get());
+          LOG(ERROR) << "Cannot read data from archive: " << error;
+          ThrowExitCode(error);
+      }
+    }
+  }
+
   // The following callbacks are used by libarchive to read the uncompressed
   // data from the archive file.
-  static ssize_t Read(Archive* const a, void* const p, const void** const out) {
+  static ssize_t Read(Archive* const a,
+                      void* const p,
+                      const void** const out) noexcept {
     assert(p);
     assert(g_archive_fd >= 0);
     Reader& r = *static_cast<Reader*>(p);
+    ScopedPhase const phase(Phase::ARCHIVE_IO);
+
+    // Use bigger reads while reading sequentially, and small reads after
+    // jumping, e.g. when hopping from header to header. Libarchive is done with
+    // the previous buffer by now.
+    r.sequential_reads = r.pos == r.read_end ? r.sequential_reads + 1 : 0;
+    i64 size = kMinReadSize;
+    if (r.sequential_reads >= kSequentialReadsBeforeGrowing) {
+      size = std::min<i64>(r.buffer_size * 2, g_options.read_size);
+    } else if (r.sequential_reads > 0) {
+      size = r.buffer_size;
+    }
+
+    if (size != r.buffer_size) {
+      // Keep the current buffer if a new one cannot be allocated.
+      if (BufferPool::Buffer b = BufferPool::Get(size)) {
+        BufferPool::Put(std::exchange(r.buffer, std::move(b)), r.buffer_size);
+        r.buffer_size = size;
+      } else if (!r.buffer) {
+        archive_set_error(a, ENOMEM, "Cannot allocate input buffer");
+        return ARCHIVE_FATAL;
+      }
+    }
+
     while (true) {
-      ssize_t const n = pread(g_archive_fd, r.bytes, sizeof(r.bytes), r.pos);
+      ssize_t const n =
+          pread(g_archive_fd, r.buffer.get(), r.buffer_size, r.pos);
       if (n >= 0) {
+        if (g_slow_io_enabled) {
+          WaitForSlowIo(n);
+        }
+
+        Profiler::AddBytes(Phase::ARCHIVE_IO, n);
         r.pos += n;
+        r.read_end = r.pos;
         r.PrintProgress();
-        *out = r.bytes;
+        *out = r.buffer.get();
         return n;
       }
 
@@ -1514,24 +2896,179 @@ struct Reader : bi::list_base_hook<LinkMode> {
   static bi::list<Reader> recycled;
 };
 
-int Reader::count = 0;
+std::atomic<int> Reader::count = 0;
 bi::list<Reader> Reader::recycled;
 
-struct FileHandle {
-  const Node* const node;
-  Reader::Ptr reader;
+class VirtualFile;
+
+// In nocache mode, an entry read at random is decompressed whole in memory
+// once. This copy is shared by all the file handles reading the entry, and it
+// is dropped when the last of them is released.
+struct EntryCopy {
+  std::vector<char> data;
+  // Number of file handles using this copy.
+  int users = 0;
 };
 
-// ---- In-Memory Directory Tree
+// Entry copies indexed by index_within_archive.
+std::unordered_map<i64, EntryCopy> g_entry_copies;
 
-// Validates, normalizes and returns e's path, prepending a leading "/" if it
-// doesn't already have one.
-std::string GetNormalizedPath(Entry* const e) {
-  const char* const s =
-      archive_entry_pathname_utf8(e) ?: archive_entry_pathname(e);
-  if (!s || !*s) {
-    LOG(ERROR) << "Entry has an empty path";
-    return "";
+// Total size of the entry copies.
+i64 g_entry_copies_size = 0;
+
+// Gets the copy of the given entry, if there is one, for a new user.
+EntryCopy* AcquireEntryCopy(i64 const index_within_archive) {
+  auto const it = g_entry_copies.find(index_within_archive);
+  if (it == g_entry_copies.end()) {
+    return nullptr;
+  }
+
+  it->second.users++;
+  return &it->second;
+}
+
+// Stores the copy of the given entry for its first user.
+EntryCopy* AddEntryCopy(i64 const index_within_archive,
+                        std::vector<char> data) {
+  EntryCopy& copy = g_entry_copies[index_within_archive];
+  assert(copy.users == 0);
+  g_entry_copies_size += data.size();
+  copy.data = std::move(data);
+  copy.users = 1;
+  g_entry_copies_made++;
+  return &copy;
+}
+
+// Drops the copy of the given entry once it has no more users.
+void ReleaseEntryCopy(i64 const index_within_archive) {
+  auto const it = g_entry_copies.find(index_within_archive);
+  assert(it != g_entry_copies.end());
+  assert(it->second.users > 0);
+  if (--it->second.users == 0) {
+    g_entry_copies_size -= it->second.data.size();
+    g_entry_copies.erase(it);
+  }
+}
+
+struct FileHandle {
+  const Node* const node;
+  Reader::Ptr reader;
+  // Virtual file served by this handle, or null for an archive entry.
+  const VirtualFile* const virtual_file = nullptr;
+  // Access pattern of the read requests in nocache mode.
+  AccessClassifier classifier;
+  AccessPattern pattern = AccessPattern::Unknown;
+  // Decompressed data of the entry, starting at buffer_offset. What it holds
+  // depends on the access pattern.
+  std::vector<char> buffer;
+  i64 buffer_offset = 0;
+  // Shared copy of the entry, for random access.
+  EntryCopy* copy = nullptr;
+  // Set while a thread updates the access pattern with "-o mmap", since
+  // several threads can read through the same handle in cache mode.
+  std::atomic_flag classifying;
+
+  // Copies the requested data from the entry copy or from the buffer if one of
+  // them holds it.
+  bool ReadFromBuffer(char* const dst_ptr,
+                      i64 const dst_len,
+                      i64 const offset) const {
+    if (copy && offset + dst_len <= i64(copy->data.size())) {
+      std::memcpy(dst_ptr, copy->data.data() + offset, dst_len);
+      return true;
+    }
+
+    if (offset < buffer_offset ||
+        offset + dst_len > buffer_offset + i64(buffer.size())) {
+      return false;
+    }
+
+    std::memcpy(dst_ptr, buffer.data() + (offset - buffer_offset), dst_len);
+    return true;
+  }
+
+  // The memory of the released handles is recycled by HandlePool.
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
+};
+
+// Released FileHandles kept by a thread for its next Open, so that opening and
+// closing files in cache mode doesn't go through the allocator. A handle can
+// be released by another thread than the one that opened it. It then goes to
+// the pool of the releasing thread.
+class HandlePool {
+ public:
+  ~HandlePool() {
+    while (head_) {
+      ::operator delete(std::exchange(head_, head_->next));
+    }
+  }
+
+  void* Get() {
+    if (!head_) {
+      return ::operator new(sizeof(FileHandle));
+    }
+
+    --size_;
+    return std::exchange(head_, head_->next);
+  }
+
+  void Put(void* const p) {
+    if (size_ >= kMaxSize) {
+      ::operator delete(p);
+      return;
+    }
+
+    ++size_;
+    head_ = new (p) Free{.next = head_};
+  }
+
+  static HandlePool& ForThisThread() {
+    thread_local HandlePool pool;
+    return pool;
+  }
+
+ private:
+  struct Free {
+    Free* next;
+  };
+
+  // Maximum number of handles kept by a thread.
+  static constexpr int kMaxSize = 64;
+
+  Free* head_ = nullptr;
+  int size_ = 0;
+};
+
+void* FileHandle::operator new(size_t const size) {
+  assert(size == sizeof(FileHandle));
+  return HandlePool::ForThisThread().Get();
+}
+
+void FileHandle::operator delete(void* const p) {
+  if (p) {
+    HandlePool::ForThisThread().Put(p);
+  }
+}
+
+// Sizes of the data decompressed into a file handle's buffer.
+constexpr i64 kReadAheadSize = 1 << 20;
+constexpr i64 kHistorySize = 4 << 20;
+constexpr i64 kMaxBufferedEntrySize = 64 << 20;
+
+// Maximum total size of the entry copies.
+constexpr i64 kMaxEntryCopiesSize = 256 << 20;
+
+// ---- In-Memory Directory Tree
+
+// Validates, normalizes and returns e's path, prepending a leading "/" if it
+// doesn't already have one.
+std::string GetNormalizedPath(Entry* const e) {
+  const char* const s =
+      archive_entry_pathname_utf8(e) ?: archive_entry_pathname(e);
+  if (!s || !*s) {
+    LOG(ERROR) << "Entry has an empty path";
+    return "";
   }
 
   Path const path = s;
@@ -1586,31 +3123,60 @@ void RemoveNumericSuffix(std::string& s) {
   s.resize(i);
 }
 
-// Finds a node by full path.
+// Finds a node by full path, looking up each component in its parent
+// directory.
 Node* FindNode(std::string_view const path) {
-  auto const it = g_nodes_by_path.find(Path(path).WithoutTrailingSeparator(),
-                                       g_nodes_by_path.hash_function(),
-                                       g_nodes_by_path.key_eq());
-  return it == g_nodes_by_path.end() ? nullptr : &*it;
+  Node* node = g_root_node;
+  for (std::size_t i = 0; node && i < path.size();) {
+    if (path[i] == '/') {
+      ++i;
+      continue;
+    }
+
+    std::size_t const j = std::min(path.find('/', i), path.size());
+    node = node->children_by_name.Find(path.substr(i, j - i));
+    i = j;
+  }
+
+  return node;
 }
 
-void RehashIfNecessary() {
-  if (g_nodes_by_path.size() > buckets.size()) {
-    Buckets new_buckets(buckets.size() * 2);
-    buckets.swap(new_buckets);
-    g_nodes_by_path.rehash({buckets.data(), buckets.size()});
+// Calls fn on each node below the given directory, depth first, with the
+// children in order.
+template <typename N, typename F>
+void ForEachDescendant(N& dir, F&& fn) {
+  std::vector<N*> stack = {&dir};
+  while (!stack.empty()) {
+    N* const n = stack.back();
+    stack.pop_back();
+    if (n != &dir) {
+      fn(*n);
+    }
+
+    // Push the children in reverse order, so that they are visited in order.
+    size_t const k = stack.size();
+    for (N& child : n->children) {
+      stack.push_back(&child);
+    }
+    std::reverse(stack.begin() + k, stack.end());
   }
 }
 
+// Indexes the given node by name in its parent directory, after renaming it if
+// another node has the same name.
 void RenameIfCollision(Node* const node) {
   assert(node);
-  auto const [pos, ok] = g_nodes_by_path.insert(*node);
-  if (ok) {
-    RehashIfNecessary();
+  assert(node->parent);
+  ChildIndex& siblings = node->parent->children_by_name;
+  // A node with an empty name would have the same path as its parent.
+  Node* pos = node->name.empty() ? node->parent : siblings.Insert(node);
+  if (!pos) {
     return;
   }
 
   // There is a name collision
+  ScopedPhase const phase(Phase::COLLISIONS);
+  Profiler::AddCount(Phase::COLLISIONS);
   LOG(DEBUG) << *node << " conflicts with " << *pos;
 
   // Extract filename extension
@@ -1628,10 +3194,9 @@ void RenameIfCollision(Node* const node) {
     f.assign(base, 0, Path(base).TruncationPosition(NAME_MAX - suffix.size()));
     f += suffix;
 
-    auto const [pos, ok] = g_nodes_by_path.insert(*node);
-    if (ok) {
+    pos = siblings.Insert(node);
+    if (!pos) {
       LOG(DEBUG) << "Resolved conflict for " << *node;
-      RehashIfNecessary();
       return;
     }
 
@@ -1663,10 +3228,10 @@ Node* GetOrCreateDirNode(std::string_view const path) {
                << Path(path);
     parent = node->parent;
 
-    // Remove it from g_nodes_by_path, in order to insert it again later with a
-    // different name.
+    // Remove it from its parent's index, in order to insert it again later with
+    // a different name.
     to_rename = node;
-    g_nodes_by_path.erase(g_nodes_by_path.iterator_to(*node));
+    parent->children_by_name.Erase(node);
   } else {
     parent = GetOrCreateDirNode(parent_path);
   }
@@ -1680,9 +3245,8 @@ Node* GetOrCreateDirNode(std::string_view const path) {
                .nlink = 2};
   parent->AddChild(node);
   assert(node->GetPath() == path);
-  [[maybe_unused]] auto const [_, ok] = g_nodes_by_path.insert(*node);
-  assert(ok);
-  RehashIfNecessary();
+  [[maybe_unused]] Node* const other = parent->children_by_name.Insert(node);
+  assert(!other);
 
   if (to_rename) {
     RenameIfCollision(to_rename);
@@ -1713,6 +3277,8 @@ bool ShouldSkip(FileType const ft) {
 void CacheEntryData(Archive* const a) {
   assert(g_cache_size >= 0);
   i64 const file_start_offset = g_cache_size;
+  i64 const archive_start_offset = archive_filter_bytes(a, -1);
+  ScopedPhase const phase(Phase::DECOMPRESSION);
 
   while (true) {
     const void* buff = nullptr;
@@ -1731,8 +3297,14 @@ void CacheEntryData(Archive* const a) {
         assert(offset >= 0);
         assert(g_cache_size <= file_start_offset + offset);
         g_cache_size = file_start_offset + offset;
+        Profiler::AddBytes(Phase::DECOMPRESSION, len);
+        CheckTotalSize(g_loaded_size + offset + len);
+        CheckExpansionRatio(offset + len,
+                            archive_filter_bytes(a, -1) - archive_start_offset);
+        CheckLoadTime();
 
         while (len > 0) {
+          ScopedPhase const write_phase(Phase::CACHE_WRITE);
           ssize_t const n = pwrite(g_cache_fd, buff, len, g_cache_size);
           if (n < 0) {
             if (errno == EINTR) {
@@ -1744,6 +3316,8 @@ void CacheEntryData(Archive* const a) {
           }
 
           assert(n <= len);
+          PROBE(cache__write, g_cache_size, n);
+          Profiler::AddBytes(Phase::CACHE_WRITE, n);
           buff = static_cast<const std::byte*>(buff) + n;
           len -= n;
           g_cache_size += n;
@@ -1760,7 +3334,9 @@ void CacheEntryData(Archive* const a) {
         // See https://github.com/google/fuse-archive/issues/40
         if (i64 const cache_size = file_start_offset + offset;
             g_cache_size < cache_size) {
+          CheckTotalSize(g_loaded_size + offset);
           g_cache_size = cache_size;
+          ScopedPhase const write_phase(Phase::CACHE_WRITE);
           while (ftruncate(g_cache_fd, g_cache_size) < 0) {
             if (errno != EINTR) {
               PLOG(ERROR) << "Cannot resize cache to " << g_cache_size
@@ -1781,7 +3357,257 @@ void CacheEntryData(Archive* const a) {
   }
 }
 
+// Extends the cache file with a hole up to the next huge page boundary.
+void AlignCacheFile() {
+  i64 const size =
+      (g_cache_size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  if (size == g_cache_size) {
+    return;
+  }
+
+  // The hole doesn't count toward -o maxsize, which only limits the size of
+  // the files.
+  while (ftruncate(g_cache_fd, size) < 0) {
+    if (errno != EINTR) {
+      PLOG(ERROR) << "Cannot resize cache to " << size << " bytes";
+      throw ExitCode::CANNOT_WRITE_CACHE;
+    }
+  }
+
+  g_cache_size = size;
+}
+
+// Gets the index in g_format_names of the format and compression method of the
+// current entry.
+std::uint16_t GetFormatId(Archive* const a) {
+  // The format name is usually the same as for the previous entry. Compare the
+  // contents, since some formats reuse the same buffer for different names.
+  static std::string last_name;
+  static std::uint16_t last_id = 0;
+  const char* const name = archive_format_name(a) ?: "unknown";
+  if (!g_format_names.empty() && name == last_name) {
+    return last_id;
+  }
+
+  std::string full_name = name;
+  for (int i = archive_filter_count(a); i > 0;) {
+    if (archive_filter_code(a, --i) != ARCHIVE_FILTER_NONE) {
+      full_name += StrCat(" + ", archive_filter_name(a, i));
+    }
+  }
+
+  auto const it =
+      std::find(g_format_names.begin(), g_format_names.end(), full_name);
+  last_name = name;
+  last_id = static_cast<std::uint16_t>(it - g_format_names.begin());
+  if (it == g_format_names.end()) {
+    g_format_names.push_back(std::move(full_name));
+  }
+
+  return last_id;
+}
+
+// Computes the archive_length of the file nodes from the archive_offset of the
+// following entries. Entries of a solid block share the same offset, and get
+// the length of the whole block.
+void ComputeArchiveLengths(bool const filtered) {
+  std::vector<Node*> nodes;
+  ForEachDescendant(*g_root_node, [&nodes](Node& n) {
+    if (n.archive_offset >= 0) {
+      nodes.push_back(&n);
+    }
+  });
+
+  std::sort(nodes.begin(), nodes.end(), [](const Node* a, const Node* b) {
+    return a->archive_offset < b->archive_offset;
+  });
+
+  // The end of the last entry is only known if the archive is not filtered.
+  i64 end = filtered ? -1 : g_archive_size;
+  for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+    Node* const n = *it;
+    if (end > n->archive_offset) {
+      n->archive_length = end - n->archive_offset;
+    }
+
+    if (std::next(it) != nodes.rend() &&
+        (*std::next(it))->archive_offset < n->archive_offset) {
+      end = n->archive_offset;
+    }
+  }
+}
+
+// Reads a little-endian integer.
+template <typename T>
+T GetLittleEndian(const char* const p) {
+  T x = 0;
+  for (std::size_t i = sizeof(T); i > 0;) {
+    x = (x << 8) | static_cast<unsigned char>(p[--i]);
+  }
+  return x;
+}
+
+// Reads the central directory of a ZIP archive, and stores the position of the
+// local headers and the CRC-32 of the entries in their nodes. This doesn't
+// touch the compressed contents.
+//
+// libarchive reads the entries in the order of their local headers, but it
+// doesn't report their actual positions.
+void ReadZipCentralDirectory(i64 const entry_count) {
+  // Find the end of central directory record. It is followed by a comment of
+  // at most 64 KiB.
+  i64 const tail_size = std::min<i64>(g_archive_size, 22 + 0xFFFF);
+  std::string tail(tail_size, '\0');
+  if (pread(g_archive_fd, tail.data(), tail_size,
+            g_archive_size - tail_size) != tail_size) {
+    PLOG(DEBUG) << "Cannot read end of ZIP archive";
+    return;
+  }
+
+  i64 eocd = tail_size - 22;
+  while (eocd >= 0 && GetLittleEndian<std::uint32_t>(&tail[eocd]) !=
+                          0x06054b50) {
+    --eocd;
+  }
+
+  if (eocd < 0) {
+    LOG(DEBUG) << "Cannot find ZIP end of central directory";
+    return;
+  }
+
+  i64 cd_size = GetLittleEndian<std::uint32_t>(&tail[eocd + 12]);
+  i64 cd_offset = GetLittleEndian<std::uint32_t>(&tail[eocd + 16]);
+  i64 cd_end = g_archive_size - tail_size + eocd;
+
+  // The ZIP64 end of central directory locator precedes the record.
+  if (eocd >= 20 &&
+      GetLittleEndian<std::uint32_t>(&tail[eocd - 20]) == 0x07064b50) {
+    i64 const offset = GetLittleEndian<std::uint64_t>(&tail[eocd - 12]);
+    char r[56];
+    if (offset < 0 || pread(g_archive_fd, r, sizeof(r), offset) != sizeof(r) ||
+        GetLittleEndian<std::uint32_t>(r) != 0x06064b50) {
+      LOG(DEBUG) << "Cannot read ZIP64 end of central directory";
+      return;
+    }
+
+    cd_size = GetLittleEndian<std::uint64_t>(r + 40);
+    cd_offset = GetLittleEndian<std::uint64_t>(r + 48);
+    cd_end = offset;
+  }
+
+  // Self-extracting archives have some data before the ZIP archive, and the
+  // offsets are relative to the start of the ZIP archive.
+  i64 const correction = cd_end - cd_size - cd_offset;
+  if (cd_size < 0 || correction < 0 || cd_offset + correction < 0) {
+    LOG(DEBUG) << "Invalid ZIP central directory";
+    return;
+  }
+
+  // Read the central directory in chunks, and collect the positions of the
+  // local headers with the CRC-32 of the entries, or -1 if unknown.
+  std::vector<std::pair<i64, i64>> entries;
+  std::string buffer;
+  std::size_t pos = 0;
+  i64 offset = cd_offset + correction;
+  i64 const end = offset + cd_size;
+
+  // Makes sure that there are n bytes in the buffer at pos.
+  auto const ensure = [&](std::size_t const n) {
+    if (buffer.size() - pos >= n) {
+      return true;
+    }
+
+    buffer.erase(0, pos);
+    pos = 0;
+    std::size_t const want =
+        std::min<i64>(std::max<std::size_t>(n, 1 << 20), end - offset);
+    if (buffer.size() + want < n) {
+      return false;
+    }
+
+    std::size_t const old_size = buffer.size();
+    buffer.resize(old_size + want);
+    if (pread(g_archive_fd, buffer.data() + old_size, want, offset) !=
+        static_cast<ssize_t>(want)) {
+      PLOG(DEBUG) << "Cannot read ZIP central directory";
+      return false;
+    }
+
+    offset += want;
+    return true;
+  };
+
+  while (ensure(46)) {
+    const char* const h = buffer.data() + pos;
+    if (GetLittleEndian<std::uint32_t>(h) != 0x02014b50) {
+      LOG(DEBUG) << "Invalid ZIP central directory header";
+      break;
+    }
+
+    std::uint16_t const method = GetLittleEndian<std::uint16_t>(h + 10);
+    std::uint32_t const crc = GetLittleEndian<std::uint32_t>(h + 16);
+    std::uint32_t const compressed_size = GetLittleEndian<std::uint32_t>(h + 20);
+    std::uint32_t const size = GetLittleEndian<std::uint32_t>(h + 24);
+    std::size_t const name_len = GetLittleEndian<std::uint16_t>(h + 28);
+    std::size_t const extra_len = GetLittleEndian<std::uint16_t>(h + 30);
+    std::size_t const comment_len = GetLittleEndian<std::uint16_t>(h + 32);
+    i64 local_offset = GetLittleEndian<std::uint32_t>(h + 42);
+    std::size_t const n = 46 + name_len + extra_len + comment_len;
+    if (!ensure(n)) {
+      break;
+    }
+
+    // The actual local header offset might be in the ZIP64 extra field, after
+    // the sizes that don't fit in 32 bits.
+    const char* const extra = buffer.data() + pos + 46 + name_len;
+    for (std::size_t i = 0; local_offset == 0xFFFFFFFF && i + 4 <= extra_len;) {
+      std::uint16_t const id = GetLittleEndian<std::uint16_t>(extra + i);
+      std::size_t const len = GetLittleEndian<std::uint16_t>(extra + i + 2);
+      i += 4;
+      if (id == 0x0001) {
+        std::size_t const j = i + 8 * (size == 0xFFFFFFFF) +
+                              8 * (compressed_size == 0xFFFFFFFF);
+        if (j + 8 <= i + len && j + 8 <= extra_len) {
+          local_offset = GetLittleEndian<std::uint64_t>(extra + j);
+        }
+        break;
+      }
+      i += len;
+    }
+
+    // WinZip AES encryption (AE-2) doesn't store the CRC-32.
+    entries.emplace_back(local_offset + correction,
+                         method == 99 && crc == 0 ? -1 : i64{crc});
+    pos += n;
+  }
+
+  if (static_cast<i64>(entries.size()) != entry_count) {
+    LOG(DEBUG) << "Mismatch between the " << entries.size()
+               << " entries in the ZIP central directory and the "
+               << entry_count << " entries read by libarchive";
+    return;
+  }
+
+  std::sort(entries.begin(), entries.end());
+
+  ForEachDescendant(*g_root_node, [&](Node& n) {
+    if (n.index_within_archive > 0 && n.index_within_archive <= entry_count) {
+      auto const [local_offset, crc] = entries[n.index_within_archive - 1];
+      n.archive_offset = local_offset;
+      // Only the CRC-32 of a regular file is the checksum of its contents.
+      if (n.GetType() == FileType::File) {
+        n.crc32 = crc;
+      }
+    }
+  });
+
+  LOG(DEBUG) << "Read the ZIP central directory of " << entry_count
+             << " entries";
+}
+
 void ProcessEntry(Reader& r) {
+  ScopedPhase const phase(Phase::TREE_BUILDING);
+  Profiler::AddCount(Phase::TREE_BUILDING);
   Archive* const a = r.archive.get();
   Entry* const e = r.entry;
   i64 const i = r.index_within_archive;
@@ -1794,6 +3620,8 @@ void ProcessEntry(Reader& r) {
     return;
   }
 
+  CheckPathDepth(path);
+
   if (const char* const s =
           archive_entry_hardlink_utf8(e) ?: archive_entry_hardlink(e)) {
     // Entry is a hard link.
@@ -1847,6 +3675,8 @@ void ProcessEntry(Reader& r) {
       .mode = static_cast<mode_t>(static_cast<mode_t>(ft) |
                                   (0666 & ~g_options.fmask)),
       .index_within_archive = i,
+      .archive_offset = archive_read_header_position(a),
+      .format_id = GetFormatId(a),
       .mtime = archive_entry_mtime_is_set(e) ? archive_entry_mtime(e) : g_now};
 
   if (g_default_permissions) {
@@ -1862,7 +3692,7 @@ void ProcessEntry(Reader& r) {
 
   parent->AddChild(node);
 
-  // Add to g_nodes_by_path.
+  // Index it by name in its parent.
   RenameIfCollision(node);
 
   // Do some extra processing depending on the file type.
@@ -1891,13 +3721,19 @@ void ProcessEntry(Reader& r) {
   if (g_cache) {
     // Cache file data.
     node->size = archive_entry_size(e);
+    if (g_mmap && node->size >= kHugePageSize) {
+      AlignCacheFile();
+    }
+
     i64 const offset = g_cache_size;
     CacheEntryData(a);
     node->cache_offset = offset;
     node->size = g_cache_size - offset;
+    g_loaded_size += node->size;
   } else {
     // Get the entry size without caching the data.
     node->size = r.GetEntrySize();
+    CheckTotalSize(g_loaded_size += node->size);
   }
 
   // Check password if necessary.
@@ -1909,6 +3745,8 @@ void ProcessEntry(Reader& r) {
 
 // Resolve the hard links set aside in g_hardlinks_to_resolve.
 void ResolveHardlinks() {
+  ScopedPhase const phase(Phase::HARDLINKS);
+  Profiler::AddCount(Phase::HARDLINKS, g_hardlinks_to_resolve.size());
   for (const Hardlink& entry : g_hardlinks_to_resolve) {
     // Find its target.
     Node* target = FindNode(entry.target_path);
@@ -2031,6 +3869,8 @@ void BuildTree() {
     LOG(DEBUG) << "Archive file size is " << g_archive_size << " bytes";
   }
 
+  Profiler::Start();
+
   // Prepare a Reader to read the archive.
   Reader r;
   r.should_print_progress = LOG_IS_ON(INFO) && g_archive_size > 0;
@@ -2041,18 +3881,24 @@ void BuildTree() {
       new Node{.name = "/",
                .mode = static_cast<mode_t>(S_IFDIR | (0777 & ~g_options.dmask)),
                .nlink = 2};
-  [[maybe_unused]] auto const [_, ok] = g_nodes_by_path.insert(*g_root_node);
-  assert(ok);
+
+  if (g_options.max_time) {
+    g_load_deadline = std::chrono::steady_clock::now() +
+                      std::chrono::seconds(g_options.max_time);
+  }
 
   // Read and process every entry of the archive.
   try {
     while (r.NextEntry()) {
       CheckRawArchive(r.archive.get());
+      CheckEntryCount(r.index_within_archive);
+      CheckLoadTime();
 
       try {
         ProcessEntry(r);
       } catch (ExitCode const error) {
-        if (!g_force) {
+        // Exceeding a limit cannot be ignored.
+        if (!g_force || error == ExitCode::LIMIT_EXCEEDED) {
           throw;
         }
 
@@ -2063,21 +3909,33 @@ void BuildTree() {
     // Resolve hard links.
     ResolveHardlinks();
 
+    if ((archive_format(r.archive.get()) & ARCHIVE_FORMAT_BASE_MASK) ==
+            ARCHIVE_FORMAT_ZIP &&
+        archive_filter_count(r.archive.get()) <= 1) {
+      ReadZipCentralDirectory(r.index_within_archive - 1);
+    }
+
+    ComputeArchiveLengths(archive_filter_count(r.archive.get()) > 1);
+
     if (g_latest_log_is_ephemeral) {
       LOG(INFO) << ProgressMessage(100);
     }
   } catch (ExitCode const error) {
-    if (!g_force || g_nodes_by_path.size() <= 1) {
+    if (!g_force || error == ExitCode::LIMIT_EXCEEDED ||
+        g_root_node->children.empty()) {
       throw;
     }
 
     LOG(DEBUG) << "Suppressing error " << error << " because of -o force";
   }
 
+  Profiler::Stop();
+  Profiler::Report(timer.Nanoseconds());
+
   // Log some debug messages.
   if (LOG_IS_ON(DEBUG)) {
     LOG(DEBUG) << "Loaded " << Path(g_archive_path) << " in " << timer;
-    LOG(DEBUG) << "The archive contains " << g_nodes_by_path.size() << " items";
+    LOG(DEBUG) << "The archive contains " << Node::count << " items";
     if (struct stat z; g_cache && fstat(g_cache_fd, &z) == 0) {
       LOG(DEBUG) << "The cache takes " << i64(z.st_blocks) * block_size
                  << " bytes of disk space";
@@ -2085,14 +3943,1062 @@ void BuildTree() {
     }
   }
 
-  // Close archive file if decompressed data is already cached.
-  if (g_cache && close(std::exchange(g_archive_fd, -1)) < 0) {
-    PLOG(ERROR) << "Cannot close archive file";
+  // Close archive file if decompressed data is already cached.
+  if (g_cache && close(std::exchange(g_archive_fd, -1)) < 0) {
+    PLOG(ERROR) << "Cannot close archive file";
+  }
+}
+
+// ---- Stat Records
+
+// Precomputed stat record of a node, and the name under which it is listed.
+struct StatRecord {
+  struct stat z;
+  const char* name;
+
+  // For a directory, position and number of the records of its children.
+  std::uint32_t first_child = 0;
+  std::uint32_t child_count = 0;
+};
+
+// Stat records of all the nodes, computed once the tree is built. Since the
+// tree doesn't change afterwards, the metadata operations just copy these
+// records. The children of each directory have consecutive records, so that
+// ReadDir reads them in a row. The first record is unused.
+std::vector<StatRecord> g_stat_records;
+
+// Computes the stat records of all the nodes, breadth first.
+void ComputeStats() {
+  std::vector<Node*> nodes = {nullptr, g_root_node};
+  g_stat_records.clear();
+  g_stat_records.reserve(Node::count + 1);
+  g_stat_records.emplace_back();
+  for (size_t i = 1; i < nodes.size(); ++i) {
+    Node* const n = nodes[i];
+    n->stat_index = i;
+    StatRecord& r = g_stat_records.emplace_back(n->GetStat(), n->name.c_str());
+    if (n->IsDir()) {
+      r.first_child = nodes.size();
+      for (Node& child : n->children) {
+        nodes.push_back(&child);
+      }
+      r.child_count = nodes.size() - r.first_child;
+    }
+  }
+
+  LOG(DEBUG) << "The stat records take "
+             << g_stat_records.size() * sizeof(StatRecord) << " bytes";
+}
+
+// Gets the stat record of the given node. The virtual files have no
+// precomputed records.
+struct stat GetStat(const Node& n) {
+  return n.stat_index ? g_stat_records[n.stat_index].z : n.GetStat();
+}
+
+// ---- Listing
+
+// Gets the length of the valid UTF-8 sequence at the start of `s`, or 0 if `s`
+// doesn't start with a valid UTF-8 sequence. Rejects overlong sequences,
+// surrogates and code points above U+10FFFF.
+size_t GetUtf8SequenceLength(std::string_view const s) {
+  if (s.empty()) {
+    return 0;
+  }
+
+  unsigned char const c = s[0];
+  if (c < 0x80) {
+    return 1;
+  }
+
+  // Range of the second byte, which is narrower for some leading bytes.
+  unsigned char lo = 0x80;
+  unsigned char hi = 0xBF;
+  size_t n;
+  if (c >= 0xC2 && c <= 0xDF) {
+    n = 2;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    n = 3;
+    if (c == 0xE0) {
+      lo = 0xA0;
+    }
+    if (c == 0xED) {
+      hi = 0x9F;
+    }
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    n = 4;
+    if (c == 0xF0) {
+      lo = 0x90;
+    }
+    if (c == 0xF4) {
+      hi = 0x8F;
+    }
+  } else {
+    return 0;
+  }
+
+  if (s.size() < n) {
+    return 0;
+  }
+
+  for (size_t i = 1; i < n; ++i) {
+    unsigned char const b = s[i];
+    if (b < lo || b > hi) {
+      return 0;
+    }
+
+    lo = 0x80;
+    hi = 0xBF;
+  }
+
+  return n;
+}
+
+// Appends the given string to `out` as a quoted JSON string. Replaces each
+// byte that isn't part of a valid UTF-8 sequence with U+FFFD, so that the
+// output is always valid JSON.
+void AppendJsonString(std::string* const out, std::string_view const s) {
+  out->push_back('"');
+  for (size_t i = 0; i < s.size();) {
+    char const c = s[i];
+    if (static_cast<unsigned char>(c) >= 0x80) {
+      size_t const n = GetUtf8SequenceLength(s.substr(i));
+      if (n == 0) {
+        out->append("\\ufffd");
+        ++i;
+      } else {
+        out->append(s.substr(i, n));
+        i += n;
+      }
+
+      continue;
+    }
+
+    switch (c) {
+      case '"':
+        out->append("\\\"");
+        break;
+      case '\\':
+        out->append("\\\\");
+        break;
+      case '\n':
+        out->append("\\n");
+        break;
+      case '\t':
+        out->append("\\t");
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          out->append(buf);
+        } else {
+          out->push_back(c);
+        }
+    }
+
+    ++i;
+  }
+  out->push_back('"');
+}
+
+// Appends a node's permissions in the style of 'ls -l', e.g. "drwxr-xr-x".
+void AppendPermissions(std::string* const out, const Node& n) {
+  static constexpr char types[] = "?pc?d?b?-?l?s???";
+  out->push_back(types[(n.mode >> 12) & 0xF]);
+  const char* const rwx = "rwxrwxrwx";
+  for (int i = 0; i < 9; ++i) {
+    out->push_back(n.mode & (0400 >> i) ? rwx[i] : '-');
+  }
+}
+
+// Appends a description of the given node, in the --list format.
+void AppendListing(std::string* const out, const Node& n) {
+  // Paths are relative to the archive root.
+  std::string const path = n.GetPath().substr(1);
+
+  if (g_list == ListFormat::JSON) {
+    out->append("{\"path\":");
+    AppendJsonString(out, path);
+    out->append(",\"type\":");
+    AppendJsonString(out, StrCat(n.GetType()));
+    out->append(",\"mode\":" + std::to_string(n.mode & 07777));
+    out->append(",\"size\":" + std::to_string(n.size));
+    out->append(",\"mtime\":" + std::to_string(n.mtime));
+    if (!n.symlink.empty()) {
+      out->append(",\"target\":");
+      AppendJsonString(out, n.symlink);
+    }
+    out->append("}\n");
+    return;
+  }
+
+  char mtime[32];
+  tm t;
+  strftime(mtime, sizeof(mtime), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&n.mtime, &t));
+
+  // The path is the last field, so that it can contain spaces.
+  AppendPermissions(out, n);
+  out->append(" " + std::to_string(n.size) + " " + mtime + " " + path);
+  if (!n.symlink.empty()) {
+    out->append(" -> " + n.symlink);
+  }
+  out->push_back(g_list == ListFormat::NUL ? '\0' : '\n');
+}
+
+// Prints the tree built by BuildTree() on the standard output, depth first.
+void ListTree() {
+  assert(g_root_node);
+  std::string out;
+  auto const flush = [&out] {
+    if (std::fwrite(out.data(), 1, out.size(), stdout) != out.size()) {
+      PLOG(ERROR) << "Cannot write listing";
+      throw ExitCode::GENERIC_FAILURE;
+    }
+    out.clear();
+  };
+
+  ForEachDescendant(*g_root_node, [&](const Node& n) {
+    AppendListing(&out, n);
+    if (out.size() >= (1 << 20)) {
+      flush();
+    }
+  });
+
+  flush();
+  if (std::fflush(stdout) != 0) {
+    PLOG(ERROR) << "Cannot write listing";
+    throw ExitCode::GENERIC_FAILURE;
+  }
+}
+
+// ---- Extraction
+
+// Coalesces the data blocks of an entry into large writes. Holes between the
+// blocks (e.g. in sparse files) are left unwritten.
+class BlockWriter {
+ public:
+  explicit BlockWriter(int const fd) : fd_(fd) {}
+
+  void Write(const void* const p, size_t const n, i64 const offset) {
+    if (offset != offset_ + i64(buffer_.size()) ||
+        buffer_.size() + n > buffer_.capacity()) {
+      Flush();
+      offset_ = offset;
+    }
+
+    if (n >= buffer_.capacity()) {
+      WriteAll(static_cast<const char*>(p), n, offset);
+      offset_ += n;
+      return;
+    }
+
+    buffer_.insert(buffer_.end(), static_cast<const char*>(p),
+                   static_cast<const char*>(p) + n);
+  }
+
+  void Flush() {
+    WriteAll(buffer_.data(), buffer_.size(), offset_);
+    offset_ += buffer_.size();
+    buffer_.clear();
+  }
+
+ private:
+  void WriteAll(const char* p, size_t n, i64 offset) {
+    while (n > 0) {
+      ssize_t const k = pwrite(fd_, p, n, offset);
+      if (k < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::system_category(), "Cannot write");
+      }
+      p += k;
+      n -= k;
+      offset += k;
+    }
+  }
+
+  static constexpr size_t buffer_size = 1 << 20;
+
+  int const fd_;
+  i64 offset_ = 0;
+  std::vector<char> buffer_ = [] {
+    std::vector<char> v;
+    v.reserve(buffer_size);
+    return v;
+  }();
+};
+
+// Number of errors encountered while extracting.
+std::atomic<int> g_extract_errors = 0;
+
+// Extracts the data of the entry the Reader is positioned at into the given
+// regular file node.
+void ExtractFile(int const root_fd, Reader& r, const Node& node) {
+  std::string const path = node.GetPath().substr(1);
+  int const fd = openat(root_fd, path.c_str(),
+                        O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                        0600);
+  if (fd < 0) {
+    PLOG(ERROR) << "Cannot create " << Path(path);
+    g_extract_errors++;
+    return;
+  }
+
+  try {
+    // Preallocate the file, unless it is sparse.
+    if (node.size > 0 && archive_entry_sparse_count(r.entry) == 0) {
+      posix_fallocate(fd, 0, node.size);
+    }
+
+    BlockWriter writer(fd);
+    while (true) {
+      const void* buff = nullptr;
+      size_t len = 0;
+      off_t offset = 0;
+      int const status =
+          archive_read_data_block(r.archive.get(), &buff, &len, &offset);
+      if (status == ARCHIVE_EOF) {
+        break;
+      }
+
+      if (status == ARCHIVE_RETRY) {
+        continue;
+      }
+
+      if (status == ARCHIVE_WARN) {
+        LOG(WARNING) << GetErrorString(r.archive.get());
+      } else if (status != ARCHIVE_OK) {
+        std::string_view const error = GetErrorString(r.archive.get());
+        LOG(ERROR) << "Cannot extract " << Path(path) << ": " << error;
+        ThrowExitCode(error);
+      }
+
+      writer.Write(buff, len, offset);
+    }
+
+    writer.Flush();
+
+    // Set the final size, which keeps any trailing hole.
+    if (ftruncate(fd, node.size) < 0) {
+      throw std::system_error(errno, std::system_category(), "Cannot resize");
+    }
+
+    fchmod(fd, node.mode & 07777);
+    timespec const times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = node.mtime}};
+    futimens(fd, times);
+  } catch (const std::system_error& e) {
+    LOG(ERROR) << e.what() << " " << Path(path) << ": " << e.code().message();
+    g_extract_errors++;
+  } catch (ExitCode const e) {
+    g_extract_errors++;
+    if (!g_force) {
+      close(fd);
+      throw;
+    }
+  }
+
+  close(fd);
+}
+
+// Extracts the given file nodes, sorted by index, with a single Reader.
+void ExtractFiles(int const root_fd, std::span<const Node* const> const nodes) {
+  Reader r;
+  for (const Node* const node : nodes) {
+    while (r.index_within_archive < node->index_within_archive) {
+      if (!r.NextEntry()) {
+        LOG(ERROR) << "Reached EOF while advancing to entry "
+                   << node->index_within_archive;
+        throw ExitCode::INVALID_ARCHIVE_HEADER;
+      }
+    }
+
+    ExtractFile(root_fd, r, *node);
+  }
+}
+
+// Extracts the tree built by BuildTree() into the given directory.
+//
+// The file data is read in archive order. For formats whose entries can be
+// skipped without decompressing them (ZIP, ISO 9660, uncompressed TAR), the
+// files are split into contiguous ranges extracted in parallel by several
+// Readers.
+void ExtractTree(const std::string& dir) {
+  assert(g_root_node);
+  Timer const timer;
+
+  if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) {
+    PLOG(ERROR) << "Cannot create directory " << Path(dir);
+    throw ExitCode::GENERIC_FAILURE;
+  }
+
+  int const root_fd = open(dir.c_str(), O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+  if (root_fd < 0) {
+    PLOG(ERROR) << "Cannot open directory " << Path(dir);
+    throw ExitCode::GENERIC_FAILURE;
+  }
+
+  // Create the directories first, and collect the other nodes.
+  std::vector<const Node*> dirs, files, links;
+  std::vector<const Node*> stack = {g_root_node};
+  while (!stack.empty()) {
+    const Node* const n = stack.back();
+    stack.pop_back();
+    if (n->IsDir()) {
+      if (n != g_root_node) {
+        std::string const path = n->GetPath().substr(1);
+        if (mkdirat(root_fd, path.c_str(), 0700) < 0 && errno != EEXIST) {
+          PLOG(ERROR) << "Cannot create directory " << Path(path);
+          g_extract_errors++;
+          continue;
+        }
+        dirs.push_back(n);
+      }
+
+      for (const Node& child : n->children) {
+        stack.push_back(&child);
+      }
+    } else if (n->hardlink_target || n->GetType() != FileType::File) {
+      links.push_back(n);
+    } else {
+      files.push_back(n);
+    }
+  }
+
+  // Extract the file data in archive order.
+  std::sort(files.begin(), files.end(), [](const Node* a, const Node* b) {
+    return a->index_within_archive < b->index_within_archive;
+  });
+
+  i64 total_size = 0;
+  for (const Node* const n : files) {
+    total_size += n->size;
+  }
+
+  int thread_count = 1;
+  if (!files.empty()) {
+    Reader r;
+    if (r.NextEntry() && CanSkipWithoutDecompressing(r.archive.get())) {
+      thread_count = std::clamp<int>(std::thread::hardware_concurrency(), 1, 8);
+    }
+  }
+
+  if (thread_count == 1) {
+    ExtractFiles(root_fd, files);
+  } else {
+    // Split the files into ranges of roughly equal sizes.
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(thread_count);
+    size_t begin = 0;
+    i64 done = 0;
+    for (int i = 0; i < thread_count && begin < files.size(); ++i) {
+      i64 const want = total_size * (i + 1) / thread_count;
+      size_t end = begin;
+      while (end < files.size() && (done < want || end == begin)) {
+        done += files[end++]->size;
+      }
+
+      if (i == thread_count - 1) {
+        end = files.size();
+      }
+
+      threads.emplace_back([&, i, begin, end] {
+        try {
+          ExtractFiles(root_fd, std::span(files).subspan(begin, end - begin));
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      });
+      begin = end;
+    }
+
+    for (std::thread& t : threads) {
+      t.join();
+    }
+
+    for (const std::exception_ptr& e : errors) {
+      if (e) {
+        std::rethrow_exception(e);
+      }
+    }
+  }
+
+  // Create the symlinks and special files, and then the hard links, which can
+  // point to symlinks.
+  std::stable_partition(links.begin(), links.end(), [](const Node* n) {
+    return !n->hardlink_target;
+  });
+
+  for (const Node* const n : links) {
+    std::string const path = n->GetPath().substr(1);
+    int res;
+    if (n->hardlink_target) {
+      std::string const target = n->hardlink_target->GetPath().substr(1);
+      res = linkat(root_fd, target.c_str(), root_fd, path.c_str(), 0);
+    } else if (n->GetType() == FileType::Symlink) {
+      res = symlinkat(n->symlink.c_str(), root_fd, path.c_str());
+    } else {
+      res = mknodat(root_fd, path.c_str(), n->mode, n->rdev);
+    }
+
+    if (res < 0) {
+      PLOG(ERROR) << "Cannot create " << n->GetType() << " " << Path(path);
+      g_extract_errors++;
+    } else if (!n->hardlink_target) {
+      timespec const times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = n->mtime}};
+      utimensat(root_fd, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+    }
+  }
+
+  // Set the directory permissions and times last, deepest first.
+  for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+    const Node* const n = *it;
+    std::string const path = n->GetPath().substr(1);
+    fchmodat(root_fd, path.c_str(), n->mode & 07777, 0);
+    timespec const times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = n->mtime}};
+    utimensat(root_fd, path.c_str(), times, 0);
+  }
+
+  close(root_fd);
+
+  LOG(INFO) << "Extracted " << files.size() << " files (" << total_size
+            << " bytes) into " << Path(dir) << " with " << thread_count
+            << " threads in " << timer;
+
+  if (g_extract_errors > 0) {
+    LOG(ERROR) << "There were " << g_extract_errors << " errors";
+    throw ExitCode::GENERIC_FAILURE;
+  }
+}
+
+// ---- Virtual Files
+
+// Virtual files are hidden files generated on the fly. They are not listed in
+// their directory, but they can be looked up and read.
+
+// Allocates a bufvec as expected by FUSE, which frees it.
+fuse_bufvec* MakeBufVec(std::span<const fuse_buf> const bufs) {
+  std::size_t const count = std::max<std::size_t>(bufs.size(), 1);
+  fuse_bufvec* const v = static_cast<fuse_bufvec*>(
+      std::malloc(sizeof(fuse_bufvec) + (count - 1) * sizeof(fuse_buf)));
+  if (!v) {
+    for (const fuse_buf& b : bufs) {
+      if (!(b.flags & FUSE_BUF_IS_FD)) {
+        std::free(b.mem);
+      }
+    }
+    throw std::bad_alloc();
+  }
+
+  v->count = count;
+  v->idx = 0;
+  v->off = 0;
+  v->buf[0] = {};
+  v->buf[0].fd = -1;
+  std::copy(bufs.begin(), bufs.end(), v->buf);
+  return v;
+}
+
+// Appends a memory buffer holding a copy of the given bytes.
+void AppendMemBuf(std::vector<fuse_buf>* const bufs,
+                  std::string_view const data) {
+  fuse_buf b = {};
+  b.size = data.size();
+  b.mem = std::malloc(data.size());
+  if (!b.mem) {
+    throw std::bad_alloc();
+  }
+  std::memcpy(b.mem, data.data(), data.size());
+  b.fd = -1;
+  bufs->push_back(b);
+}
+
+class VirtualFile {
+ public:
+  explicit VirtualFile(Node&& node) : node(std::move(node)) {}
+  virtual ~VirtualFile() = default;
+
+  // Gets the data at the given position.
+  virtual fuse_bufvec* Read(i64 offset, i64 size) const = 0;
+
+  // Synthetic node of this file.
+  Node node;
+};
+
+// Virtual files created on first access.
+std::mutex g_virtual_files_mutex;
+
+// ---- TAR Export
+
+// With "-o tarexport", each directory has a hidden file named
+// ".fuse-archive.tar" that is not listed in the directory. This file is a TAR
+// archive of the directory's subtree, generated on the fly: the headers are
+// synthesized from the nodes, and the file contents are read from the cache.
+
+constexpr std::string_view kTarExportName = ".fuse-archive.tar";
+
+// Size of a TAR block.
+constexpr i64 kTarBlockSize = 512;
+
+i64 RoundUpToTarBlock(i64 const n) {
+  return (n + kTarBlockSize - 1) & ~(kTarBlockSize - 1);
+}
+
+// Appends a PAX extended header record.
+void AppendPaxRecord(std::string* const out,
+                     std::string_view const key,
+                     std::string_view const value) {
+  // The record length includes the digits of the length itself.
+  std::size_t const n = key.size() + value.size() + 3;
+  std::size_t len = n;
+  while (len != n + std::to_string(len).size()) {
+    len = n + std::to_string(len).size();
+  }
+
+  out->append(std::to_string(len) + " ");
+  out->append(key);
+  out->push_back('=');
+  out->append(value);
+  out->push_back('\n');
+}
+
+// Appends a ustar header block. Values that don't fit are truncated, and should
+// be provided in a preceding PAX extended header.
+void AppendTarBlock(std::string* const out,
+                    const Node& n,
+                    std::string_view const name,
+                    char const type,
+                    i64 const size,
+                    std::string_view const linkname) {
+  char b[kTarBlockSize] = {};
+
+  // Writes an octal number in the given field, with a terminating NUL.
+  auto const put = [&b](std::size_t const offset, int const width,
+                        i64 const value) {
+    unsigned long long const max = (1ULL << (3 * (width - 1))) - 1;
+    unsigned long long const x =
+        std::min<unsigned long long>(std::max<i64>(value, 0), max);
+    std::snprintf(b + offset, width, "%0*llo", width - 1, x);
+  };
+
+  std::memcpy(b, name.data(), std::min<std::size_t>(name.size(), 100));
+  put(100, 8, n.mode & 07777);
+  put(108, 8, n.uid);
+  put(116, 8, n.gid);
+  put(124, 12, size);
+  put(136, 12, n.mtime);
+  b[156] = type;
+  std::memcpy(b + 157, linkname.data(),
+              std::min<std::size_t>(linkname.size(), 100));
+  std::memcpy(b + 257, "ustar\0" "00", 8);
+  if (type == '3' || type == '4') {
+    put(329, 8, major(n.rdev));
+    put(337, 8, minor(n.rdev));
+  }
+
+  // The checksum is computed with the checksum field filled with spaces.
+  std::memset(b + 148, ' ', 8);
+  unsigned int sum = 0;
+  for (char const c : b) {
+    sum += static_cast<unsigned char>(c);
+  }
+  std::snprintf(b + 148, 7, "%06o", sum);
+
+  out->append(b, kTarBlockSize);
+}
+
+// Entry of an exported TAR archive.
+struct TarMember {
+  // Position of the entry's header in the TAR archive.
+  i64 offset;
+  // Size of the header, including any PAX extended header.
+  i64 header_size;
+  const Node* node;
+  // For a hard link, the node whose path it links to. Null otherwise.
+  const Node* link;
+
+  // Gets the size of the file contents following the header.
+  i64 GetBodySize() const {
+    return link || node->GetType() != FileType::File ? 0
+                                                     : node->GetTarget()->size;
+  }
+};
+
+// TAR archive of a directory's subtree.
+class TarExport : public VirtualFile {
+ public:
+  explicit TarExport(const Node& dir)
+      : VirtualFile(Node{
+            .name = std::string(kTarExportName),
+            .mode = static_cast<mode_t>(S_IFREG | (0666 & ~g_options.fmask)),
+            .ino = Node::count + dir.ino,
+            .mtime = dir.mtime,
+            .parent = const_cast<Node*>(&dir)}),
+        prefix_size_(dir.parent ? dir.GetPath().size() + 1 : 1) {
+    i64 offset = 0;
+    std::unordered_map<const Node*, const Node*> links;
+    ForEachDescendant(dir, [&](const Node& n) {
+      FileType const ft = n.GetType();
+      if (ft == FileType::Socket ||
+          (ft == FileType::File && n.GetTarget()->cache_offset < 0)) {
+        LOG(DEBUG) << "Cannot export " << n << " in TAR archive";
+        return;
+      }
+
+      // The first path of a hard-linked file gets the contents. The other
+      // paths are hard links to it.
+      TarMember m = {.offset = offset, .node = &n, .link = nullptr};
+      if (ft == FileType::File && n.GetTarget()->nlink > 1) {
+        auto const [it, inserted] = links.try_emplace(n.GetTarget(), &n);
+        if (!inserted) {
+          m.link = it->second;
+        }
+      }
+
+      m.header_size = GetHeader(m).size();
+      offset += m.header_size + RoundUpToTarBlock(m.GetBodySize());
+      members_.push_back(m);
+    });
+
+    // The archive ends with two zero blocks.
+    node.size = offset + 2 * kTarBlockSize;
+    LOG(DEBUG) << "Mapped TAR archive of " << dir << " with "
+               << members_.size() << " entries and " << node.size << " bytes";
+  }
+
+  // Gets the data at the given position. The file contents are not copied:
+  // they are passed as parts of the cache file, which FUSE can splice.
+  fuse_bufvec* Read(i64 const offset, i64 const size) const override {
+    std::vector<fuse_buf> bufs;
+    std::string mem;
+
+    // Moves the bytes accumulated in mem to a memory buffer.
+    auto const flush = [&bufs, &mem] {
+      if (!mem.empty()) {
+        AppendMemBuf(&bufs, mem);
+        mem.clear();
+      }
+    };
+
+    i64 const end = std::min(offset + size, node.size);
+    i64 pos = offset;
+    auto it = std::upper_bound(
+        members_.begin(), members_.end(), pos,
+        [](i64 const pos, const TarMember& m) { return pos < m.offset; });
+    if (it != members_.begin()) {
+      --it;
+    }
+
+    for (; pos < end && it != members_.end(); ++it) {
+      const TarMember& m = *it;
+      i64 const body = m.offset + m.header_size;
+      i64 const body_end = body + m.GetBodySize();
+      i64 const next = body + RoundUpToTarBlock(m.GetBodySize());
+
+      if (pos < body) {
+        i64 const n = std::min(end, body) - pos;
+        mem.append(GetHeader(m), pos - m.offset, n);
+        pos += n;
+      }
+
+      if (pos < end && pos < body_end) {
+        flush();
+        fuse_buf b = {};
+        b.size = std::min(end, body_end) - pos;
+        b.flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        b.fd = g_cache_fd;
+        b.pos = m.node->GetTarget()->cache_offset + (pos - body);
+        bufs.push_back(b);
+        pos += b.size;
+      }
+
+      if (pos < end && pos < next) {
+        i64 const n = std::min(end, next) - pos;
+        mem.append(n, '\0');
+        pos += n;
+      }
+    }
+
+    // Final zero blocks.
+    if (pos < end) {
+      mem.append(end - pos, '\0');
+    }
+
+    flush();
+    return MakeBufVec(bufs);
+  }
+
+ private:
+  // Generates the header of the given member, including any PAX extended
+  // header.
+  std::string GetHeader(const TarMember& m) const {
+    const Node& n = *m.node;
+    std::string path = n.GetPath().substr(prefix_size_);
+    std::string linkname;
+    i64 const size = m.GetBodySize();
+    char type;
+
+    if (m.link) {
+      type = '1';
+      linkname = m.link->GetPath().substr(prefix_size_);
+    } else {
+      switch (n.GetType()) {
+        case FileType::Directory:
+          type = '5';
+          path.push_back('/');
+          break;
+        case FileType::Symlink:
+          type = '2';
+          linkname = n.symlink;
+          break;
+        case FileType::CharDevice:
+          type = '3';
+          break;
+        case FileType::BlockDevice:
+          type = '4';
+          break;
+        case FileType::Fifo:
+          type = '6';
+          break;
+        default:
+          type = '0';
+      }
+    }
+
+    std::string pax;
+    if (path.size() > 100) {
+      AppendPaxRecord(&pax, "path", path);
+    }
+    if (linkname.size() > 100) {
+      AppendPaxRecord(&pax, "linkpath", linkname);
+    }
+    if (size > 077777777777) {
+      AppendPaxRecord(&pax, "size", std::to_string(size));
+    }
+    if (n.mtime < 0 || n.mtime > 077777777777) {
+      AppendPaxRecord(&pax, "mtime", std::to_string(n.mtime));
+    }
+    if (n.uid > 07777777) {
+      AppendPaxRecord(&pax, "uid", std::to_string(n.uid));
+    }
+    if (n.gid > 07777777) {
+      AppendPaxRecord(&pax, "gid", std::to_string(n.gid));
+    }
+
+    std::string out;
+    if (!pax.empty()) {
+      AppendTarBlock(&out, n, "PaxHeader", 'x', pax.size(), {});
+      out.append(pax);
+      out.resize(RoundUpToTarBlock(out.size()));
+    }
+
+    AppendTarBlock(&out, n, path, type, size, linkname);
+    return out;
+  }
+
+  // Size of the exported directory's path prefix to remove from the paths.
+  std::size_t const prefix_size_;
+
+  // Members sorted by offset.
+  std::vector<TarMember> members_;
+};
+
+// TAR exports by directory.
+std::unordered_map<const Node*, std::unique_ptr<const TarExport>> g_tar_exports;
+
+// Gets the TAR export at the given path, e.g. "/foo/.fuse-archive.tar", or null
+// if there is none.
+const TarExport* GetTarExport(std::string_view path) {
+  if (!g_tar_export || !path.ends_with(kTarExportName)) {
+    return nullptr;
+  }
+
+  path.remove_suffix(kTarExportName.size());
+  if (!path.ends_with('/')) {
+    return nullptr;
+  }
+
+  if (path.size() > 1) {
+    path.remove_suffix(1);
+  }
+
+  const Node* const dir = FindNode(path);
+  if (!dir || !dir->IsDir()) {
+    return nullptr;
+  }
+
+  std::lock_guard const lock(g_virtual_files_mutex);
+  std::unique_ptr<const TarExport>& p = g_tar_exports[dir];
+  if (!p) {
+    p = std::make_unique<const TarExport>(*dir);
+  }
+
+  return p.get();
+}
+
+// ---- Manifest
+
+// With "-o manifest", the root directory has a hidden file named
+// ".fuse-archive.manifest" describing the whole tree, with one JSON object per
+// line. Indexers can read it with a few large reads, instead of walking the
+// tree with many readdir and stat calls.
+
+constexpr std::string_view kManifestPath = "/.fuse-archive.manifest";
+
+// Appends the manifest line describing the given node.
+void AppendManifestLine(std::string* const out, const Node& n) {
+  std::string const path = n.GetPath();
+  out->append("{\"path\":");
+  AppendJsonString(out, std::string_view(path).substr(1));
+  out->append(",\"ino\":" + std::to_string(n.ino));
+  out->append(",\"mode\":" + std::to_string(n.mode));
+  out->append(",\"size\":" + std::to_string(n.size));
+  out->append(",\"mtime\":" + std::to_string(n.mtime));
+  out->append(",\"nlink\":" + std::to_string(n.GetTarget()->nlink));
+  if (!n.symlink.empty()) {
+    out->append(",\"target\":");
+    AppendJsonString(out, n.symlink);
+  }
+  out->append("}\n");
+}
+
+// Manifest of the whole tree. Only the position of each line is kept, and the
+// lines are generated again when read.
+class Manifest : public VirtualFile {
+ public:
+  Manifest()
+      : VirtualFile(Node{
+            .name = std::string(kManifestPath.substr(1)),
+            .mode = static_cast<mode_t>(S_IFREG | (0666 & ~g_options.fmask)),
+            .ino = 2 * Node::count + 1,
+            .mtime = g_root_node->mtime,
+            .parent = g_root_node}) {
+    i64 offset = 0;
+    std::string line;
+    ForEachDescendant(*g_root_node, [&](const Node& n) {
+      lines_.push_back({.offset = offset, .node = &n});
+      line.clear();
+      AppendManifestLine(&line, n);
+      offset += line.size();
+    });
+
+    node.size = offset;
+    LOG(DEBUG) << "Mapped manifest of " << lines_.size() << " lines and "
+               << node.size << " bytes";
+  }
+
+  fuse_bufvec* Read(i64 const offset, i64 const size) const override {
+    std::vector<fuse_buf> bufs;
+    i64 const end = std::min(offset + size, node.size);
+    if (offset < end) {
+      auto it = std::upper_bound(
+          lines_.begin(), lines_.end(), offset,
+          [](i64 const offset, const Line& l) { return offset < l.offset; });
+      assert(it != lines_.begin());
+      --it;
+
+      i64 const start = it->offset;
+      std::string mem;
+      for (; it != lines_.end() && it->offset < end; ++it) {
+        AppendManifestLine(&mem, *it->node);
+      }
+
+      AppendMemBuf(&bufs,
+                   std::string_view(mem).substr(offset - start, end - offset));
+    }
+
+    return MakeBufVec(bufs);
+  }
+
+ private:
+  struct Line {
+    i64 offset;
+    const Node* node;
+  };
+
+  // Lines sorted by offset.
+  std::vector<Line> lines_;
+};
+
+std::unique_ptr<const Manifest> g_manifest_file;
+
+// Gets the manifest if it is at the given path, or null.
+const Manifest* GetManifest(std::string_view const path) {
+  if (!g_manifest || path != kManifestPath) {
+    return nullptr;
+  }
+
+  std::lock_guard const lock(g_virtual_files_mutex);
+  if (!g_manifest_file) {
+    g_manifest_file = std::make_unique<const Manifest>();
+  }
+
+  return g_manifest_file.get();
+}
+
+// ---- Mapped Cache
+
+// Maps the complete cache file in memory if requested by "-o mmap". Falls back
+// to reading the cache file if it cannot be mapped.
+void MapCacheFile() {
+  if (!g_mmap || g_cache_size == 0) {
+    return;
+  }
+
+  void* const p =
+      mmap(nullptr, g_cache_size, PROT_READ, MAP_SHARED, g_cache_fd, 0);
+  if (p == MAP_FAILED) {
+    PLOG(WARNING) << "Cannot map cache file";
+    return;
+  }
+
+#ifdef MADV_HUGEPAGE
+  // Only effective if the cache file is on a filesystem supporting huge pages,
+  // such as a tmpfs mounted with the "huge" option.
+  madvise(p, g_cache_size, MADV_HUGEPAGE);
+#endif
+
+  g_cache_map = static_cast<const char*>(p);
+  LOG(DEBUG) << "Mapped cache file of " << g_cache_size << " bytes";
+}
+
+// Tells the kernel how the mapped data of the given node is accessed.
+void AdviseCacheMap(const Node& node, AccessPattern const pattern) {
+  assert(g_cache_map);
+  static i64 const page_size = sysconf(_SC_PAGESIZE);
+  i64 const start = node.cache_offset / page_size * page_size;
+  i64 const end = node.cache_offset + node.size;
+  int const advice = pattern == AccessPattern::Sequential ? MADV_SEQUENTIAL
+                     : pattern == AccessPattern::Random   ? MADV_RANDOM
+                                                          : MADV_NORMAL;
+  if (madvise(const_cast<char*>(g_cache_map) + start, end - start, advice) <
+      0) {
+    PLOG(DEBUG) << "Cannot advise " << pattern << " access for " << node;
   }
 }
 
 // ---- FUSE Callbacks
 
+// Gets the virtual file at the given path, or null if there is none.
+const VirtualFile* GetVirtualFile(std::string_view const path) {
+  if (const VirtualFile* const f = GetManifest(path)) {
+    return f;
+  }
+
+  return GetTarExport(path);
+}
+
+// Finds the node at the given path, including the virtual files.
+const Node* FindNodeOrVirtualFile(std::string_view const path) {
+  if (const Node* const n = FindNode(path)) {
+    return n;
+  }
+
+  const VirtualFile* const f = GetVirtualFile(path);
+  return f ? &f->node : nullptr;
+}
+
 int GetAttr(const char* const path,
 #if FUSE_USE_VERSION >= 30
             struct stat* const z,
@@ -2111,7 +5017,7 @@ int GetAttr(const char* const path,
     assert(n);
   } else {
     assert(path);
-    n = FindNode(path);
+    n = FindNodeOrVirtualFile(path);
     if (!n) {
       LOG(DEBUG) << "Cannot stat " << Path(path) << ": No such item";
       return -ENOENT;
@@ -2119,7 +5025,7 @@ int GetAttr(const char* const path,
   }
 
   assert(z);
-  *z = n->GetStat();
+  *z = GetStat(*n);
   return 0;
 }
 
@@ -2147,6 +5053,14 @@ int Open(const char* const path, fuse_file_info* const fi) try {
   assert(path);
   const Node* const n = FindNode(path);
   if (!n) {
+    if (const VirtualFile* const f = GetVirtualFile(path)) {
+      assert(fi);
+      fi->fh = reinterpret_cast<uintptr_t>(
+          new FileHandle{.node = &f->node, .virtual_file = f});
+      LOG(DEBUG) << "Opened " << f->node;
+      return 0;
+    }
+
     LOG(ERROR) << "Cannot open " << Path(path) << ": No such item";
     return -ENOENT;
   }
@@ -2165,7 +5079,19 @@ int Open(const char* const path, fuse_file_info* const fi) try {
 
   assert(fi);
   static_assert(sizeof(fi->fh) >= sizeof(FileHandle*));
-  fi->fh = reinterpret_cast<uintptr_t>(new FileHandle{.node = n});
+  FileHandle* const h = new FileHandle{.node = n};
+  fi->fh = reinterpret_cast<uintptr_t>(h);
+
+  if (!g_cache) {
+    // Start with the access pattern last seen for this entry. For random
+    // access, this gets or makes the entry copy at the first read.
+    if (auto const it = g_entry_stats.find(n->index_within_archive);
+        it != g_entry_stats.end()) {
+      h->pattern = it->second.pattern;
+    }
+  }
+
+  TRACE(FUSE_OPEN, 0, n->index_within_archive, 0, n->size);
   LOG(DEBUG) << "Opened " << *n;
   return 0;
 } catch (...) {
@@ -2173,6 +5099,8 @@ int Open(const char* const path, fuse_file_info* const fi) try {
   return -EIO;
 }
 
+// Decompresses the requested data of an archive entry in nocache mode. In
+// cache mode, ReadBuf() serves the data from the cache file.
 int Read(const char*,
          char* const dst_ptr,
          size_t dst_len,
@@ -2189,32 +5117,12 @@ int Read(const char*,
   const Node* const node = h->node;
   assert(node);
 
-  if (g_cache) {
-    if (offset >= node->size) {
-      // No data past the end of a file.
-      return 0;
-    }
-
-    if (dst_len >= node->size - offset) {
-      // No data past the end of a file.
-      dst_len = node->size - offset;
-    }
-
-    assert(node->cache_offset >= 0);
-    offset += node->cache_offset;
-
-    // Read data from the cache file.
-    ssize_t const n = pread(g_cache_fd, dst_ptr, dst_len, offset);
-    if (n < 0) {
-      int const e = errno;
-      PLOG(ERROR) << "Cannot read " << dst_len << " bytes from cache at offset "
-                  << offset;
-      return -e;
-    }
+  TraceSpan span = {.event = TraceEvent::FUSE_READ,
+                    .index_within_archive = node->index_within_archive,
+                    .offset_within_entry = offset,
+                    .length = i64(dst_len)};
 
-    assert(n <= dst_len);
-    return n;
-  }
+  assert(!g_cache);
 
   i64 const size = node->size;
   assert(size >= 0);
@@ -2231,42 +5139,149 @@ int Read(const char*,
     return 0;
   }
 
+  EntryStats& stats = g_entry_stats[node->index_within_archive];
+  stats.node = node;
+
+  if (AccessPattern const p = h->classifier.Update(offset, dst_len);
+      p != AccessPattern::Unknown && p != h->pattern) {
+    LOG(DEBUG) << "Switching to " << p << " access for " << *node;
+    h->pattern = p;
+    stats.pattern = p;
+    g_pattern_switches[int(p)]++;
+  }
+
+  // Use the copy made for another handle reading this entry at random.
+  if (h->pattern == AccessPattern::Random && !h->copy) {
+    h->copy = AcquireEntryCopy(node->index_within_archive);
+  }
+
+  if (h->ReadFromBuffer(dst_ptr, dst_len, offset)) {
+    stats.served += dst_len;
+    stats.buffered += dst_len;
+    return dst_len;
+  }
+
   if (ReadFromSideBuffer(node->index_within_archive, dst_ptr, dst_len,
                          offset)) {
+    stats.served += dst_len;
+    TRACE(SIDE_BUFFER_HIT, 0, node->index_within_archive, offset, dst_len);
+    PROBE(side__buffer__hit, node->index_within_archive, offset, dst_len);
     return dst_len;
   }
 
+  TRACE(SIDE_BUFFER_MISS, 0, node->index_within_archive, offset, dst_len);
+  PROBE(side__buffer__miss, node->index_within_archive, offset, dst_len);
+
+  if (const ReadFailure* const f =
+          FindFailure(node->index_within_archive, offset, dst_len)) {
+    LOG(DEBUG) << "Cannot read " << *node << " from offset " << offset
+               << ": Previously failed at offset " << f->offset << " with "
+               << f->error;
+    return -EIO;
+  }
+
+  // Decompress more than requested into the handle's buffer, depending on the
+  // access pattern.
+  i64 start = offset;
+  i64 end = offset + dst_len;
+  bool make_copy = false;
+  switch (h->pattern) {
+    case AccessPattern::Sequential:
+      // Read ahead.
+      end = std::max(end, std::min(offset + kReadAheadSize, size));
+      break;
+
+    case AccessPattern::Backward:
+      // Keep the data preceding the requested range, where the next requests
+      // will probably be.
+      start = std::max<i64>(end - kHistorySize, 0);
+      if (h->reader && h->reader->offset_within_entry <= offset) {
+        start = std::max(start, h->reader->offset_within_entry);
+      }
+      break;
+
+    case AccessPattern::Random:
+      // Decompress the whole entry once into a shared copy, if it is not too
+      // big and the copies don't take too much memory yet.
+      if (!h->copy && size <= kMaxBufferedEntrySize &&
+          g_entry_copies_size + size <= kMaxEntryCopiesSize) {
+        make_copy = true;
+        start = 0;
+        end = size;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  // Don't buffer past a known failure.
+  if (auto const it = g_read_failures.find(node->index_within_archive);
+      it != g_read_failures.end()) {
+    end = std::min(end, it->second.offset);
+    assert(end >= offset + i64(dst_len));
+  }
+
   // libarchive is designed for streaming access, not random access. If we
   // need to seek backwards, there's more work to do.
   if (Reader* const r = h->reader.get()) {
     assert(r->index_within_archive == node->index_within_archive);
-    if (offset < r->offset_within_entry) {
-      LOG(DEBUG) << *r << " cannot jump " << r->offset_within_entry - offset
+    if (start < r->offset_within_entry) {
+      LOG(DEBUG) << *r << " cannot jump " << r->offset_within_entry - start
                  << " bytes backwards from offset " << r->offset_within_entry
-                 << " to " << offset;
+                 << " to " << start;
       h->reader.reset();
-    } else if (offset > r->offset_within_entry + SIDE_BUFFER_SIZE) {
+    } else if (h->pattern == AccessPattern::Strided) {
+      // Keep skipping forward with the same Reader.
+    } else if (start > r->offset_within_entry + SIDE_BUFFER_SIZE) {
       LOG(DEBUG) << *r << " might have to jump "
-                 << offset - r->offset_within_entry
+                 << start - r->offset_within_entry
                  << " bytes forwards from offset " << r->offset_within_entry
-                 << " to " << offset;
+                 << " to " << start;
       h->reader.reset();
     }
   }
 
   if (h->reader) {
     assert(h->reader->index_within_archive == node->index_within_archive);
-    h->reader->AdvanceOffset(offset);
+    h->reader->AdvanceOffset(start);
   } else {
-    h->reader = Reader::ReuseOrCreate(node->index_within_archive, offset);
+    h->reader = Reader::ReuseOrCreate(node->index_within_archive, start);
   }
 
   assert(h->reader);
   assert(h->reader->index_within_archive == node->index_within_archive);
-  assert(h->reader->offset_within_entry == offset);
+  assert(h->reader->offset_within_entry == start);
+  span.reader_id = h->reader->id;
+
+  if (make_copy) {
+    std::vector<char> data(end);
+    ssize_t const n = h->reader->Read(data.data(), data.size());
+    assert(n >= 0);
+    stats.read += n;
+    stats.served += dst_len;
+    std::memcpy(dst_ptr, data.data() + offset, dst_len);
+    h->copy = AddEntryCopy(node->index_within_archive, std::move(data));
+    return dst_len;
+  }
+
+  if (start < offset || end > offset + i64(dst_len)) {
+    h->buffer.clear();
+    h->buffer.resize(end - start);
+    h->buffer_offset = start;
+    ssize_t const n = h->reader->Read(h->buffer.data(), h->buffer.size());
+    assert(n >= 0);
+    stats.read += n;
+    stats.served += dst_len;
+    std::memcpy(dst_ptr, h->buffer.data() + (offset - start), dst_len);
+    return dst_len;
+  }
+
   ssize_t const n = h->reader->Read(dst_ptr, dst_len);
   assert(n >= 0);
   assert(n <= dst_len);
+  stats.read += n;
+  stats.served += dst_len;
   if (n < dst_len) {
     // Pad the buffer with NUL bytes. This is a workaround for
     // https://github.com/libarchive/libarchive/issues/1194.
@@ -2277,6 +5292,106 @@ int Read(const char*,
   }
 
   return dst_len;
+} catch (ExitCode const e) {
+  // Remember where reading this entry failed.
+  FileHandle* const h = reinterpret_cast<FileHandle*>(fi->fh);
+  RecordFailure(h->node->index_within_archive,
+                h->reader ? h->reader->offset_within_entry : offset, e);
+  // Don't recycle a Reader in an unknown state.
+  delete h->reader.release();
+  h->buffer.clear();
+  return -EIO;
+} catch (...) {
+  LOG(DEBUG) << "Caught exception";
+  return -EIO;
+}
+
+int ReadBuf(const char* const path,
+            fuse_bufvec** const bufp,
+            size_t size,
+            off_t const offset,
+            fuse_file_info* const fi) try {
+  if (offset < 0 || size > std::numeric_limits<int>::max()) {
+    return -EINVAL;
+  }
+
+  assert(fi);
+  FileHandle* const h = reinterpret_cast<FileHandle*>(fi->fh);
+  assert(h);
+
+  const Node* const node = h->node;
+  assert(node);
+
+  assert(bufp);
+  if (const VirtualFile* const f = h->virtual_file) {
+    *bufp = f->Read(offset, size);
+    return 0;
+  }
+
+  if (!g_cache) {
+    // Decompress into a memory buffer.
+    std::vector<fuse_buf> bufs(1);
+    bufs[0].mem = std::malloc(size);
+    if (!bufs[0].mem && size > 0) {
+      return -ENOMEM;
+    }
+
+    int const n = Read(path, static_cast<char*>(bufs[0].mem), size, offset, fi);
+    if (n < 0) {
+      std::free(bufs[0].mem);
+      return n;
+    }
+
+    bufs[0].size = n;
+    bufs[0].fd = -1;
+    *bufp = MakeBufVec(bufs);
+    return 0;
+  }
+
+  TraceSpan const span = {.event = TraceEvent::FUSE_READ,
+                          .index_within_archive = node->index_within_archive,
+                          .offset_within_entry = offset,
+                          .length = i64(size)};
+
+  fuse_buf b = {};
+  b.size = std::clamp<i64>(node->size - offset, 0, size);
+  assert(node->cache_offset >= 0);
+
+  if (g_cache_map) {
+    // The access pattern is only a hint. Don't wait for another thread
+    // updating it.
+    if (b.size > 0 &&
+        !h->classifying.test_and_set(std::memory_order_acquire)) {
+      if (AccessPattern const p = h->classifier.Update(offset, b.size);
+          p != AccessPattern::Unknown && p != h->pattern) {
+        LOG(DEBUG) << "Switching to " << p << " access for " << *node;
+        h->pattern = p;
+        AdviseCacheMap(*node, p);
+      }
+
+      h->classifying.clear(std::memory_order_release);
+    }
+
+    // Copy the data from the mapped cache file.
+    b.mem = std::malloc(b.size);
+    if (!b.mem && b.size > 0) {
+      return -ENOMEM;
+    }
+
+    std::memcpy(b.mem, g_cache_map + node->cache_offset + offset, b.size);
+    b.fd = -1;
+    *bufp = MakeBufVec({&b, 1});
+    return 0;
+  }
+
+  // Let FUSE read the data from the cache file, possibly with splice.
+  b.flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  b.fd = g_cache_fd;
+  b.pos = node->cache_offset + offset;
+  *bufp = MakeBufVec({&b, 1});
+  return 0;
+} catch (const std::bad_alloc&) {
+  return -ENOMEM;
 } catch (...) {
   LOG(DEBUG) << "Caught exception";
   return -EIO;
@@ -2289,6 +5404,11 @@ int Release(const char*, fuse_file_info* const fi) {
 
   const Node* const n = h->node;
   assert(n);
+  TRACE(FUSE_RELEASE, 0, n->index_within_archive, 0, 0);
+  if (h->copy) {
+    ReleaseEntryCopy(n->index_within_archive);
+  }
+
   delete h;
 
   LOG(DEBUG) << "Closed " << *n;
@@ -2332,6 +5452,7 @@ int ReadDir(const char*,
   const Node* const n = reinterpret_cast<const Node*>(fi->fh);
   assert(n);
   assert(n->IsDir());
+  assert(n->stat_index);
 
   const auto add = [buf, filler, n](const char* const name,
                                     const struct stat* const z) {
@@ -2345,22 +5466,21 @@ int ReadDir(const char*,
     }
   };
 
-  struct stat z = n->GetStat();
-  add(".", &z);
+  const StatRecord& r = g_stat_records[n->stat_index];
+  add(".", &r.z);
 
   if (const Node* const parent = n->parent) {
-    z = parent->GetStat();
-    add("..", &z);
+    add("..", &g_stat_records[parent->stat_index].z);
   } else {
     add("..", nullptr);
   }
 
-  for (const Node& child : n->children) {
-    struct stat const z = child.GetStat();
-    add(child.name.c_str(), &z);
+  for (const StatRecord& child :
+       std::span(g_stat_records).subspan(r.first_child, r.child_count)) {
+    add(child.name, &child.z);
   }
 
-  LOG(DEBUG) << "List " << *n << " -> " << n->children.size() << " items";
+  LOG(DEBUG) << "List " << *n << " -> " << r.child_count << " items";
   return 0;
 } catch (const std::bad_alloc&) {
   return -ENOMEM;
@@ -2381,8 +5501,178 @@ int StatFs(const char*, struct statvfs* const z) {
   return 0;
 }
 
+// Prefix of the extended attributes describing the layout of a node in the
+// archive.
+constexpr std::string_view kXattrPrefix = "user.archive.";
+
+// Names of these extended attributes, without the prefix, in listing order.
+constexpr std::string_view kXattrNames[] = {"index", "offset", "length",
+                                            "method", "crc32",  "cached"};
+
+// Gets the extended attribute "user.archive.<key>" of a node.
+// Returns false if the node doesn't have this attribute.
+bool GetNodeXattr(const Node& node, std::string_view const key,
+                  std::string* const val) {
+  assert(val);
+  const Node& n = *node.GetTarget();
+  if (n.index_within_archive <= 0) {
+    return false;
+  }
+
+  if (key == "index") {
+    *val = std::to_string(n.index_within_archive);
+    return true;
+  }
+
+  if (key == "offset") {
+    if (n.archive_offset < 0) {
+      return false;
+    }
+
+    *val = std::to_string(n.archive_offset);
+    return true;
+  }
+
+  if (key == "length") {
+    if (n.archive_length < 0) {
+      return false;
+    }
+
+    *val = std::to_string(n.archive_length);
+    return true;
+  }
+
+  if (key == "method") {
+    if (n.format_id >= g_format_names.size()) {
+      return false;
+    }
+
+    *val = g_format_names[n.format_id];
+    return true;
+  }
+
+  if (key == "crc32") {
+    if (n.crc32 < 0) {
+      return false;
+    }
+
+    char crc[9];
+    std::snprintf(crc, sizeof(crc), "%08x", static_cast<unsigned>(n.crc32));
+    *val = crc;
+    return true;
+  }
+
+  if (key == "cached") {
+    if (n.GetType() != FileType::File) {
+      return false;
+    }
+
+    *val = g_cache && n.cache_offset >= 0 ? "1" : "0";
+    return true;
+  }
+
+  return false;
+}
+
+// Copies the value of an extended attribute, or gets its size if size is 0.
+int ReplyXattr(std::string_view const val,
+               char* const value,
+               size_t const size) {
+  if (size == 0) {
+    return val.size();
+  }
+
+  if (size < val.size()) {
+    return -ERANGE;
+  }
+
+  std::memcpy(value, val.data(), val.size());
+  return val.size();
+}
+
+int GetXattr(const char* const path,
+             const char* const name,
+             char* const value,
+#ifdef __APPLE__
+             size_t const size,
+             uint32_t) {
+#else
+             size_t const size) {
+#endif
+  assert(path);
+  assert(name);
+
+  // Don't bother looking up the node for the attributes we don't provide, such
+  // as the "security.*" ones probed by the kernel.
+  std::string_view key = name;
+  if (!key.starts_with(kXattrPrefix)) {
+    return -ENODATA;
+  }
+
+  key.remove_prefix(kXattrPrefix.size());
+
+  // In nocache mode, reading "user.archive.retry" on the root directory gets
+  // the number of failed entries, and forgets these failures. This attribute
+  // is not listed, so that dumping all the attributes doesn't have this side
+  // effect.
+  if (!g_cache && key == "retry" && std::string_view(path) == "/") {
+    int const res =
+        ReplyXattr(std::to_string(g_read_failures.size()), value, size);
+    if (size > 0 && res >= 0) {
+      ForgetFailures();
+    }
+
+    return res;
+  }
+
+  const Node* const n = FindNodeOrVirtualFile(path);
+  if (!n) {
+    return -ENOENT;
+  }
+
+  std::string val;
+  if (!GetNodeXattr(*n, key, &val)) {
+    return -ENODATA;
+  }
+
+  return ReplyXattr(val, value, size);
+}
+
+int ListXattr(const char* const path, char* const list, size_t const size) {
+  assert(path);
+  const Node* const n = FindNodeOrVirtualFile(path);
+  if (!n) {
+    return -ENOENT;
+  }
+
+  std::string names;
+  std::string val;
+  for (std::string_view const key : kXattrNames) {
+    if (GetNodeXattr(*n, key, &val)) {
+      names += kXattrPrefix;
+      names += key;
+      names.push_back('\0');
+    }
+  }
+
+  if (size == 0) {
+    return names.size();
+  }
+
+  if (size < names.size()) {
+    return -ERANGE;
+  }
+
+  std::memcpy(list, names.data(), names.size());
+  return names.size();
+}
+
 #if FUSE_USE_VERSION >= 30
-void* Init(fuse_conn_info*, fuse_config* const cfg) {
+void* Init(fuse_conn_info* const conn, fuse_config* const cfg) {
+  assert(conn);
+  // Let FUSE splice the data read from the cache file.
+  conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+
   assert(cfg);
   // Respect inode numbers.
   cfg->use_ino = true;
@@ -2392,21 +5682,203 @@ void* Init(fuse_conn_info*, fuse_config* const cfg) {
 }
 #endif
 
+constexpr char kGetAttr[] = "getattr";
+constexpr char kReadLink[] = "readlink";
+constexpr char kOpen[] = "open";
+constexpr char kReadBuf[] = "read_buf";
+constexpr char kStatFs[] = "statfs";
+constexpr char kRelease[] = "release";
+constexpr char kOpenDir[] = "opendir";
+constexpr char kReadDir[] = "readdir";
+constexpr char kGetXattr[] = "getxattr";
+constexpr char kListXattr[] = "listxattr";
+
+// ---- Operation Recording
+
+// When enabled with "-o record=FILE", each FUSE operation is appended to FILE
+// as a fixed-size binary record. The recording can be replayed against a fresh
+// mount with tools/replay.py.
+
+enum class OpCode : std::uint16_t {
+  GETATTR = 1,
+  READLINK = 2,
+  OPEN = 3,
+  READ = 4,
+  STATFS = 5,
+  RELEASE = 6,
+  OPENDIR = 7,
+  READDIR = 8,
+  GETXATTR = 9,
+  LISTXATTR = 10,
+};
+
+constexpr OpCode GetOpCode(const char* const name) {
+  return name == kGetAttr    ? OpCode::GETATTR
+         : name == kReadLink ? OpCode::READLINK
+         : name == kOpen     ? OpCode::OPEN
+         : name == kReadBuf  ? OpCode::READ
+         : name == kStatFs   ? OpCode::STATFS
+         : name == kRelease  ? OpCode::RELEASE
+         : name == kOpenDir  ? OpCode::OPENDIR
+         : name == kReadDir  ? OpCode::READDIR
+         : name == kGetXattr ? OpCode::GETXATTR
+                             : OpCode::LISTXATTR;
+}
+
+// An operation record. Its layout is part of the recording file format.
+struct OpRecord {
+  // Start and end times in nanoseconds, from CLOCK_MONOTONIC.
+  std::uint64_t start;
+  std::uint64_t end;
+  // Inode number of the target node, or 0 if unknown.
+  i64 ino;
+  i64 offset;
+  i64 size;
+  // Returned value: negated error number, or number of bytes read.
+  std::int32_t result;
+  std::uint16_t thread_id;
+  OpCode op;
+};
+
+static_assert(sizeof(OpRecord) == 48);
+
+// Header of a recording file.
+struct OpRecordFileHeader {
+  char magic[8] = {'F', 'A', 'R', 'E', 'C', 'O', 'R', 'D'};
+  std::uint32_t record_size = sizeof(OpRecord);
+  std::uint32_t reserved = 0;
+};
+
+// Recording file, or null if not recording.
+FILE* g_record_file = nullptr;
+
+// Gets a small number identifying the current thread.
+std::uint16_t GetThreadId() {
+  static std::atomic<std::uint16_t> count = 0;
+  thread_local std::uint16_t const id = count++;
+  return id;
+}
+
+// Starts recording if requested by the "-o record=FILE" option. The file is
+// opened now, because the current directory changes when daemonizing.
+void SetUpRecording() {
+  if (!g_options.record) {
+    return;
+  }
+
+  g_record_file = std::fopen(g_options.record, "we");
+  if (!g_record_file) {
+    PLOG(ERROR) << "Cannot create recording file " << Path(g_options.record);
+    throw ExitCode::GENERIC_FAILURE;
+  }
+
+  OpRecordFileHeader const header;
+  std::fwrite(&header, sizeof(header), 1, g_record_file);
+}
+
+void StopRecording() {
+  if (g_record_file) {
+    std::fclose(g_record_file);
+    g_record_file = nullptr;
+  }
+}
+
+// Gets the node targeted by an operation, before performing it.
+template <const char* name, typename... Args>
+const Node* GetOpNode(const char* const path, Args... args) {
+  if (path) {
+    return FindNodeOrVirtualFile(path);
+  }
+
+  if constexpr ((std::is_same_v<Args, fuse_file_info*> || ...)) {
+    const fuse_file_info* const fi =
+        std::get<fuse_file_info*>(std::tuple(args...));
+    if (!fi || !fi->fh) {
+      return nullptr;
+    }
+
+    if constexpr (name == kReadDir) {
+      return reinterpret_cast<const Node*>(fi->fh);
+    } else {
+      return reinterpret_cast<const FileHandle*>(fi->fh)->node;
+    }
+  }
+
+  return nullptr;
+}
+
+template <const char* name, typename... Args>
+void RecordOp(std::uint64_t const start,
+              const Node* const node,
+              int const result,
+              Args... args) {
+  OpRecord r = {.start = start,
+                .end = GetMonotonicNanoseconds(),
+                .ino = node ? static_cast<i64>(node->ino) : 0,
+                .result = result,
+                .thread_id = GetThreadId(),
+                .op = GetOpCode(name)};
+
+  if constexpr (name == kReadBuf) {
+    r.offset = std::get<off_t>(std::tuple(args...));
+    r.size = std::get<size_t>(std::tuple(args...));
+    // ReadBuf returns 0 on success. Record the number of bytes read instead,
+    // so that short reads can be told apart.
+    if (result == 0) {
+      r.result = fuse_buf_size(*std::get<fuse_bufvec**>(std::tuple(args...)));
+    }
+  } else if constexpr (name == kReadDir) {
+    r.offset = std::get<off_t>(std::tuple(args...));
+  }
+
+  // The stdio lock keeps the records whole when several threads write.
+  std::fwrite(&r, sizeof(r), 1, g_record_file);
+}
+
+// Wraps a FUSE callback to fire the op__entry and op__return probes around it,
+// and to record it if requested.
+template <const char* name, auto callback>
+struct Op;
+
+template <const char* name,
+          typename... Args,
+          int (*callback)(const char*, Args...)>
+struct Op<name, callback> {
+  static int Call(const char* const path, Args... args) {
+    ReportStatsIfRequested();
+    PROBE(op__entry, name, path);
+    if (!g_record_file) {
+      int const res = callback(path, args...);
+      PROBE(op__return, name, res);
+      return res;
+    }
+
+    std::uint64_t const start = GetMonotonicNanoseconds();
+    const Node* const node = GetOpNode<name>(path, args...);
+    int const res = callback(path, args...);
+    RecordOp<name>(start, node, res, args...);
+    PROBE(op__return, name, res);
+    return res;
+  }
+};
+
 fuse_operations const operations = {
-    .getattr = GetAttr,
-    .readlink = ReadLink,
-    .open = Open,
-    .read = Read,
-    .statfs = StatFs,
-    .release = Release,
-    .opendir = OpenDir,
-    .readdir = ReadDir,
+    .getattr = Op<kGetAttr, GetAttr>::Call,
+    .readlink = Op<kReadLink, ReadLink>::Call,
+    .open = Op<kOpen, Open>::Call,
+    .statfs = Op<kStatFs, StatFs>::Call,
+    .release = Op<kRelease, Release>::Call,
+    .getxattr = Op<kGetXattr, GetXattr>::Call,
+    .listxattr = Op<kListXattr, ListXattr>::Call,
+    .opendir = Op<kOpenDir, OpenDir>::Call,
+    .readdir = Op<kReadDir, ReadDir>::Call,
 #if FUSE_USE_VERSION >= 30
     .init = Init,
 #else
     .flag_nullpath_ok = true,
     .flag_nopath = true,
 #endif
+    .read_buf = Op<kReadBuf, ReadBuf>::Call,
 };
 
 // ---- Main
@@ -2476,6 +5948,34 @@ int ProcessArg(void*, const char* const arg, int const key, fuse_args*) {
       g_default_permissions = true;
       return KEEP;
 
+    case KEY_STATS:
+      g_stats = true;
+      return DISCARD;
+
+    case KEY_LIST:
+      g_list = ListFormat::TEXT;
+      return DISCARD;
+
+    case KEY_LIST_JSON:
+      g_list = ListFormat::JSON;
+      return DISCARD;
+
+    case KEY_LIST_NUL:
+      g_list = ListFormat::NUL;
+      return DISCARD;
+
+    case KEY_TAR_EXPORT:
+      g_tar_export = true;
+      return DISCARD;
+
+    case KEY_MANIFEST:
+      g_manifest = true;
+      return DISCARD;
+
+    case KEY_MMAP:
+      g_mmap = true;
+      return DISCARD;
+
 #if FUSE_USE_VERSION >= 30
     case KEY_DIRECT_IO:
       g_direct_io = true;
@@ -2545,6 +6045,8 @@ general options:
     -o opt,[opt...]        mount options
     -h   --help            print help
     -V   --version         print version
+    --list[=text|json|nul] list the archive contents instead of mounting
+    --extract=DIR          extract the archive into DIR instead of mounting
 
 )" PROGRAM_NAME R"( options:
     -q   -o quiet          do not print progress messages
@@ -2556,7 +6058,20 @@ general options:
     -o nosymlinks          no symlinks
     -o nohardlinks         no hard links
     -o dmask=M             directory permission mask in octal (default 0022)
-    -o fmask=M             file permission mask in octal (default 0022))"
+    -o fmask=M             file permission mask in octal (default 0022)
+    -o trace=FILE          record hot-path events into FILE
+    -o profile=FILE        write mount-time profile as JSON into FILE
+    -o record=FILE         record all the FUSE operations into FILE
+    -o tarexport           serve hidden .fuse-archive.tar files
+    -o manifest            serve a hidden .fuse-archive.manifest file
+    -o mmap                read the cache file through a memory mapping
+    -o readsize=N          max size of the reads from the archive in bytes
+    -o stats               log decompression statistics when unmounting
+    -o maxsize=N           max total size of the files in bytes
+    -o maxratio=N          max expansion ratio of a cached file
+    -o maxentries=N        max number of entries in the archive
+    -o maxdepth=N          max number of components in a path
+    -o maxtime=N           max time to load the archive in seconds)"
 #if FUSE_USE_VERSION >= 30
                R"(
     -o direct_io           use direct I/O)"
@@ -2566,6 +6081,9 @@ general options:
 
 }  // namespace
 
+// The benchmarks in bench/bench.cc include this file and provide their own
+// main function.
+#ifndef FUSE_ARCHIVE_NO_MAIN
 int main(int const argc, char** const argv) try {
   // Ensure that numbers in debug messages have thousands separators.
   // It makes big numbers much easier to read (eg sizes expressed in bytes).
@@ -2623,6 +6141,49 @@ int main(int const argc, char** const argv) try {
     return EXIT_FAILURE;
   }
 
+  if (g_options.read_size > kMaxReadSize) {
+    LOG(ERROR) << "The read size cannot be more than " << kMaxReadSize
+               << " bytes";
+    throw ExitCode::GENERIC_FAILURE;
+  }
+
+  // The input buffers of the Readers are powers of two.
+  g_options.read_size = std::bit_floor(
+      std::max<unsigned long long>(g_options.read_size, kMinReadSize));
+
+  SetUpTracing();
+  SetUpStats();
+  SetUpRecording();
+  SetUpSlowIo();
+
+  // In --list mode, only read the metadata of the entries. No cache and no
+  // mount point are needed.
+  if (g_list != ListFormat::NONE) {
+    g_cache = false;
+    BuildTree();
+    ListTree();
+    return EXIT_SUCCESS;
+  }
+
+  // In --extract mode, write the tree directly into the given directory.
+  if (g_options.extract) {
+    g_cache = false;
+    BuildTree();
+    ExtractTree(g_options.extract);
+    return EXIT_SUCCESS;
+  }
+
+  // The TAR exports read the file contents from the cache.
+  if (g_tar_export && !g_cache) {
+    LOG(WARNING) << "Ignoring -o tarexport because of -o nocache";
+    g_tar_export = false;
+  }
+
+  if (g_mmap && !g_cache) {
+    LOG(WARNING) << "Ignoring -o mmap because of -o nocache";
+    g_mmap = false;
+  }
+
   // Determine where the mount point should be.
   std::string mount_point_parent, mount_point_basename;
   bool const mount_point_specified_by_user = !g_mount_point.empty();
@@ -2661,6 +6222,8 @@ int main(int const argc, char** const argv) try {
 
   // Read archive and build tree.
   BuildTree();
+  ComputeStats();
+  MapCacheFile();
 
   // Create the mount point if it does not already exist.
   Cleanup cleanup;
@@ -2721,6 +6284,11 @@ int main(int const argc, char** const argv) try {
 
   // Start serving the filesystem.
   int const res = fuse_main(args.argc, args.argv, &operations, nullptr);
+  DumpTraceRings();
+  StopRecording();
+  if (g_stats || LOG_IS_ON(DEBUG)) {
+    ReportStats();
+  }
   LOG(DEBUG) << "Returning " << ExitCode(res);
   return res;
 } catch (ExitCode const e) {
@@ -2731,3 +6299,4 @@ int main(int const argc, char** const argv) try {
   LOG(DEBUG) << "Returning " << ExitCode::GENERIC_FAILURE;
   return static_cast<int>(ExitCode::GENERIC_FAILURE);
 }
+#endif  // FUSE_ARCHIVE_NO_MAIN
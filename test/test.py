@@ -14,16 +14,24 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import errno
 import hashlib
+import io
+import json
 import logging
 import os
 import pprint
 import random
+import re
 import stat
+import struct
 import subprocess
 import sys
+import tarfile
 import tempfile
 import time
+import zipfile
+import zlib
 
 
 # Computes the MD5 hash of the given file.
@@ -148,6 +156,33 @@ def MountArchiveAndGetTree(zip_name, options=[], password='', use_md5=True):
             logging.debug(f'Unmounted {zip_path!r} from {mount_point!r}')
 
 
+# Mounts the given archive in the foreground, so that its log messages can be
+# read by UnmountAndGetLog. Returns the mounter process.
+def MountInForeground(archive_path, mount_point, options=[]):
+    p = subprocess.Popen(
+        [mount_program, '-f', *options, archive_path, mount_point],
+        stdin=subprocess.DEVNULL,
+        stderr=subprocess.PIPE,
+        encoding='UTF-8',
+    )
+    for _ in range(100):
+        if os.path.ismount(mount_point):
+            return p
+        if p.poll() is not None:
+            break
+        time.sleep(0.1)
+
+    p.kill()
+    raise RuntimeError(
+        f'Cannot mount {archive_path!r}: {p.communicate()[1]!r}')
+
+
+# Unmounts an archive mounted by MountInForeground, and returns its log.
+def UnmountAndGetLog(p, mount_point):
+    subprocess.run(['fusermount', '-u', mount_point], check=True)
+    return p.communicate(timeout=10)[1]
+
+
 # Mounts the given archive, checks the mounted archive tree and unmounts.
 # Logs an error if the archive cannot be mounted.
 def MountArchiveAndCheckTree(
@@ -1352,19 +1387,554 @@ def TestInvalidArchive():
             CheckArchiveMountingError(f.name, 11)
 
 
+# Tests the limits on the archive contents, which cannot be ignored with force.
+def TestLimits():
+    for options in [[], ['-o', 'nocache'], ['-o', 'force']]:
+        CheckArchiveMountingError(
+            'archive.zip', 40, options + ['-o', 'maxentries=5'])
+        CheckArchiveMountingError(
+            'archive.zip', 40, options + ['-o', 'maxdepth=1'])
+        CheckArchiveMountingError(
+            'archive.zip', 40, options + ['-o', 'maxsize=1000'])
+
+    CheckArchiveMountingError(
+        'zeroes-256mib.tar.gz', 40, ['-o', 'force,maxratio=100'])
+    CheckArchiveMountingError(
+        'zeroes-256mib.tar.gz', 40, ['-o', 'nocache,maxsize=1000000'])
+    # The size of a raw compressed file is only known once decompressed.
+    CheckArchiveMountingError(
+        'archive.zip.gz', 40, ['-o', 'nocache,maxsize=1000'])
+    MountArchiveAndGetTree(
+        'archive.zip',
+        options=['-o', 'maxentries=100,maxdepth=2,maxratio=100,maxtime=60'])
+
+    # The alignment holes of the cache file don't count toward maxsize.
+    with tempfile.TemporaryDirectory() as tmp:
+        tar_path = os.path.join(tmp, 'big-files.tar')
+        rng = random.Random(1)
+        with tarfile.open(tar_path, 'w') as t:
+            for i in range(3):
+                data = rng.randbytes(5 << 19)
+                info = tarfile.TarInfo(f'{i}.bin')
+                info.size = len(data)
+                t.addfile(info, io.BytesIO(data))
+        for options in [[], ['-o', 'mmap']]:
+            MountArchiveAndGetTree(
+                tar_path, options=options + ['-o', 'maxsize=8000000'],
+                use_md5=False)
+            CheckArchiveMountingError(
+                tar_path, 40, options + ['-o', f'maxsize={(15 << 19) - 1}'])
+
+
+# Tests that hot-path events are dumped into the trace file at exit.
+def TestTrace():
+    zip_name = 'archive.zip'
+    logging.info(f'Test {zip_name!r}, options = trace')
+    with tempfile.TemporaryDirectory() as tmp:
+        trace_path = os.path.join(tmp, 'trace')
+        # The relative path is resolved before the daemon changes directory.
+        cwd = os.getcwd()
+        os.chdir(tmp)
+        try:
+            MountArchiveAndGetTree(
+                zip_name, options=['-o', 'nocache,trace=trace'])
+        finally:
+            os.chdir(cwd)
+
+        # The trace is dumped by the daemon when it exits after unmounting.
+        for _ in range(50):
+            if os.path.exists(trace_path):
+                break
+            time.sleep(0.1)
+
+        try:
+            with open(trace_path, 'rb') as f:
+                data = f.read()
+        except OSError as e:
+            LogError(f'Cannot read trace file: {e}')
+            return
+
+        if not data.startswith(b'FATRACE1'):
+            LogError(f'Unexpected trace header: {data[:16]!r}')
+        elif (len(data) - 16) % 48 != 0 or len(data) == 16:
+            LogError(f'Unexpected trace size: {len(data)}')
+
+
+# Tests that the FUSE operations are recorded.
+def TestRecord():
+    zip_name = 'archive.zip'
+    logging.info(f'Test {zip_name!r}, options = record')
+    with tempfile.TemporaryDirectory() as tmp:
+        record_path = os.path.join(tmp, 'record')
+        MountArchiveAndGetTree(zip_name, options=['-o', f'record={record_path}'])
+
+        # The recording is closed by the daemon when it exits after unmounting.
+        ops = set()
+        for _ in range(50):
+            try:
+                with open(record_path, 'rb') as f:
+                    data = f.read()
+            except OSError as e:
+                LogError(f'Cannot read recording file: {e}')
+                return
+
+            if not data.startswith(b'FARECORD'):
+                LogError(f'Unexpected recording header: {data[:16]!r}')
+                return
+
+            # The op code is the last field of each 48-byte record.
+            ops = {data[i + 46] for i in range(16, len(data) - 47, 48)}
+            if {1, 3, 4, 6, 7, 8} <= ops:
+                break
+            time.sleep(0.1)
+        else:
+            LogError(f'Missing operations in recording: {sorted(ops)}')
+            return
+
+        # The READ records (op code 4) hold the number of bytes read.
+        n = (len(data) - 16) // 48 * 48
+        reads = [(size, result) for *_, size, result, _, op in
+                 struct.iter_unpack('<QQqqqiHH', data[16:16 + n]) if op == 4]
+        if not any(result > 0 for _, result in reads) or \
+                any(not 0 <= result <= size for size, result in reads):
+            LogError(f'Unexpected results of READ records: {reads}')
+
+
+# Tests the reads of a file in nocache mode with different access patterns.
+def TestAccessPatterns():
+    logging.info('Test access patterns, options = nocache,direct_io,stats')
+    with tempfile.TemporaryDirectory() as tmp:
+        line = b'%08d The quick brown fox jumps over the lazy dog.\n'
+        want = b''.join(line % i for i in range(50000))
+        zip_path = os.path.join(tmp, 'lines.zip')
+        with zipfile.ZipFile(zip_path, 'w', zipfile.ZIP_DEFLATED) as z:
+            z.writestr('lines.txt', want)
+
+        mount_point = os.path.join(tmp, 'mnt')
+        p = MountInForeground(
+            zip_path, mount_point, ['-o', 'nocache,direct_io,stats'])
+        try:
+            n = 4096
+            rng = random.Random(1)
+            path = os.path.join(mount_point, 'lines.txt')
+
+            # Reads at the given offsets, alternating between file handles.
+            def read(pattern, offsets, handles=1):
+                fds = [os.open(path, os.O_RDONLY) for _ in range(handles)]
+                try:
+                    for i, offset in enumerate(offsets):
+                        offset = max(offset, 0)
+                        got = os.pread(fds[i % handles], n, offset)
+                        if got != want[offset:offset + n]:
+                            LogError(f'Mismatch at offset {offset} for '
+                                     f'{pattern} reads')
+                            break
+                finally:
+                    for fd in fds:
+                        os.close(fd)
+
+            read('sequential', range(0, len(want), n))
+            read('strided', range(0, len(want), 3 * n))
+            read('backward', range(len(want) - n, -n, -n))
+            read('random', [rng.randrange(len(want)) for _ in range(100)])
+            # The handles opened after random reads share a single copy of
+            # the entry.
+            read('random', [rng.randrange(len(want)) for _ in range(400)], 4)
+        finally:
+            log = UnmountAndGetLog(p, mount_point)
+
+        m = re.search(r'Served (\d+) bytes from file handle buffers and (\d+) '
+                      r'entry copies, with handles switching to (\d+) '
+                      r'Sequential, (\d+) Strided, (\d+) Backward, (\d+) '
+                      r'Random', log)
+        if not m:
+            LogError(f'Missing access pattern statistics in {log!r}')
+            return
+
+        buffered, copies, *switches = map(int, m.groups())
+        if buffered <= 0:
+            LogError(f'No bytes served from buffers: {m[0]!r}')
+        if copies not in (1, 2):
+            LogError(f'Want 1 or 2 entry copies: {m[0]!r}')
+        if 0 in switches:
+            LogError(f'Missing access pattern switches: {m[0]!r}')
+
+
+# Tests that the reads of a corrupted entry keep failing without affecting the
+# other entries, that the failure is remembered, and that it can be forgotten.
+def TestReadFailures():
+    zip_name = 'archive.zip'
+    logging.info(f'Test corrupted {zip_name!r}, options = nocache,direct_io')
+    with tempfile.TemporaryDirectory() as tmp:
+        # Corrupt the compressed contents of romeo.txt.
+        zip_path = os.path.join(tmp, zip_name)
+        with open(os.path.join(script_dir, 'data', zip_name), 'rb') as f:
+            data = bytearray(f.read())
+        with zipfile.ZipFile(os.path.join(script_dir, 'data', zip_name)) as z:
+            info = z.getinfo('romeo.txt')
+            want = z.read('hello.sh')
+        name_size, extra_size = struct.unpack_from(
+            '<HH', data, info.header_offset + 26)
+        start = info.header_offset + 30 + name_size + extra_size + 200
+        for i in range(start, start + 64):
+            data[i] ^= 0x55
+        with open(zip_path, 'wb') as f:
+            f.write(data)
+
+        mount_point = os.path.join(tmp, 'mnt')
+        p = MountInForeground(
+            zip_path, mount_point, ['-o', 'nocache,direct_io,stats'])
+        try:
+            def check():
+                path = os.path.join(mount_point, 'romeo.txt')
+                try:
+                    with open(path, 'rb') as f:
+                        f.read()
+                    LogError('Read corrupted romeo.txt without error')
+                except OSError as e:
+                    if e.errno != errno.EIO:
+                        LogError(f'Unexpected error for romeo.txt: {e}')
+
+                with open(os.path.join(mount_point, 'hello.sh'), 'rb') as f:
+                    if f.read() != want:
+                        LogError('Mismatch for hello.sh contents')
+
+            for _ in range(3):
+                check()
+
+            # Forget the failure, and try again.
+            got = os.getxattr(mount_point, 'user.archive.retry')
+            if got != b'1':
+                LogError(f'Mismatch for user.archive.retry: {got!r}')
+            check()
+        finally:
+            log = UnmountAndGetLog(p, mount_point)
+
+        # The entry is only decompressed again after the retry.
+        m = re.search(r'with \d+ restarts and (\d+) failures', log)
+        if not m:
+            LogError(f'Missing failure statistics in {log!r}')
+        elif m[1] != '2':
+            LogError(f'Want 2 failures: {m[0]!r}')
+
+
+# Tests the extended attributes describing the layout of the entries.
+def TestXattrs(options=[]):
+    zip_name = 'archive.zip'
+    s = f'Test {zip_name!r}, xattrs'
+    if options: s += f', options = {" ".join(options)!r}'
+    logging.info(s)
+    with tempfile.TemporaryDirectory() as mount_point:
+        zip_path = os.path.join(script_dir, 'data', zip_name)
+        subprocess.run(
+            [mount_program, *options, zip_path, mount_point],
+            check=True,
+            capture_output=True,
+            input='',
+            encoding='UTF-8',
+        )
+        try:
+            path = os.path.join(mount_point, 'romeo.txt')
+            want_names = {
+                'user.archive.index', 'user.archive.offset',
+                'user.archive.length', 'user.archive.method',
+                'user.archive.crc32', 'user.archive.cached',
+            }
+            got_names = set(os.listxattr(path))
+            if got_names != want_names:
+                LogError(f'Mismatch for xattr names: got: {got_names}')
+
+            got = {n: os.getxattr(path, n) for n in got_names}
+            want_cached = b'0' if 'nocache' in options else b'1'
+            if not got['user.archive.index'].isdigit() or \
+                    not got['user.archive.offset'].isdigit() or \
+                    not got['user.archive.method'].startswith(b'ZIP ') or \
+                    got['user.archive.cached'] != want_cached:
+                LogError(f'Mismatch for xattrs: got: {got}')
+
+            with open(os.path.join(script_dir, 'data', 'romeo.txt'), 'rb') as f:
+                want_crc = b'%08x' % zlib.crc32(f.read())
+            if got['user.archive.crc32'] != want_crc:
+                LogError(f'Mismatch for CRC-32: got: {got["user.archive.crc32"]}, '
+                         f'want: {want_crc}')
+
+            for name in ['user.archive.missing', 'user.other']:
+                try:
+                    os.getxattr(path, name)
+                    LogError(f'Want error for missing xattr {name!r}')
+                except OSError as e:
+                    if e.errno != errno.ENODATA:
+                        LogError(f'Unexpected error for missing xattr {name!r}: {e}')
+        finally:
+            subprocess.run(['fusermount', '-u', '-z', mount_point], check=True)
+
+    # Only the regular files get a CRC-32, even if the ZIP central directory
+    # has one for the other entries.
+    with tempfile.TemporaryDirectory() as tmp:
+        zip_path = os.path.join(tmp, 'entries.zip')
+        with zipfile.ZipFile(zip_path, 'w') as z:
+            z.writestr('dir/', '')
+            z.writestr('dir/file.txt', 'Hello\n')
+            info = zipfile.ZipInfo('link')
+            info.external_attr = (stat.S_IFLNK | 0o777) << 16
+            z.writestr(info, 'dir/file.txt')
+
+        mount_point = os.path.join(tmp, 'mnt')
+        os.mkdir(mount_point)
+        subprocess.run(
+            [mount_program, *options, zip_path, mount_point],
+            check=True,
+            capture_output=True,
+            input='',
+            encoding='UTF-8',
+        )
+        try:
+            for name, want in [('dir', False), ('dir/file.txt', True),
+                               ('link', False)]:
+                path = os.path.join(mount_point, name)
+                got = 'user.archive.crc32' in os.listxattr(
+                    path, follow_symlinks=False)
+                if got != want:
+                    LogError(f'Mismatch for CRC-32 of {name!r}: got: {got}')
+        finally:
+            subprocess.run(['fusermount', '-u', '-z', mount_point], check=True)
+
+
+# Tests the hidden TAR archives of the directories.
+def TestTarExport():
+    zip_name = 'hardlinks.tgz'
+    logging.info(f'Test {zip_name!r}, options = tarexport')
+    with tempfile.TemporaryDirectory() as mount_point:
+        zip_path = os.path.join(script_dir, 'data', zip_name)
+        subprocess.run(
+            [mount_program, '-o', 'tarexport', zip_path, mount_point],
+            check=True,
+            capture_output=True,
+            input='',
+            encoding='UTF-8',
+        )
+        try:
+            if '.fuse-archive.tar' in os.listdir(mount_point):
+                LogError('TAR export is listed')
+
+            for subdir in ['', 'Dir1']:
+                root = os.path.join(mount_point, subdir)
+                with tarfile.open(os.path.join(root, '.fuse-archive.tar')) as t:
+                    members = t.getmembers()
+                    if not members:
+                        LogError(f'Empty TAR export of {subdir!r}')
+                    for m in members:
+                        path = os.path.join(root, m.name)
+                        st = os.lstat(path)
+                        if m.isdir() != stat.S_ISDIR(st.st_mode) or \
+                                m.issym() != stat.S_ISLNK(st.st_mode) or \
+                                m.mtime != st.st_mtime:
+                            LogError(f'Mismatch for {m.name!r} in TAR export')
+                        elif m.issym():
+                            if m.linkname != os.readlink(path):
+                                LogError(f'Mismatch for {m.name!r} target')
+                        elif m.isfile() or m.islnk():
+                            with open(path, 'rb') as f:
+                                want = f.read()
+                            if t.extractfile(m).read() != want:
+                                LogError(f'Mismatch for {m.name!r} contents')
+        finally:
+            subprocess.run(['fusermount', '-u', '-z', mount_point], check=True)
+
+
+# Tests the hidden manifest of the tree.
+def TestManifest(options=[]):
+    zip_name = 'hardlinks.tgz'
+    logging.info(f'Test {zip_name!r}, options = {options} + manifest')
+    with tempfile.TemporaryDirectory() as mount_point:
+        zip_path = os.path.join(script_dir, 'data', zip_name)
+        subprocess.run(
+            [mount_program, *options, '-o', 'manifest', zip_path, mount_point],
+            check=True,
+            capture_output=True,
+            input='',
+            encoding='UTF-8',
+        )
+        try:
+            if '.fuse-archive.manifest' in os.listdir(mount_point):
+                LogError('Manifest is listed')
+
+            want = set()
+            for dirpath, dirnames, filenames in os.walk(mount_point):
+                for name in dirnames + filenames:
+                    want.add(os.path.relpath(os.path.join(dirpath, name),
+                                             mount_point))
+
+            got = set()
+            path = os.path.join(mount_point, '.fuse-archive.manifest')
+            with open(path, encoding='UTF-8') as f:
+                for line in f:
+                    item = json.loads(line)
+                    got.add(item['path'])
+                    st = os.lstat(os.path.join(mount_point, item['path']))
+                    if (item['ino'], item['mode'], item['size'], item['mtime'],
+                            item['nlink']) != (st.st_ino, st.st_mode,
+                                               st.st_size, int(st.st_mtime),
+                                               st.st_nlink):
+                        LogError(f'Mismatch for {item["path"]!r} in manifest')
+                    if stat.S_ISLNK(st.st_mode) and item.get('target') != \
+                            os.readlink(os.path.join(mount_point, item['path'])):
+                        LogError(f'Mismatch for {item["path"]!r} target')
+
+            if got != want:
+                LogError(f'Want manifest paths {want!r}, got {got!r}')
+        finally:
+            subprocess.run(['fusermount', '-u', '-z', mount_point], check=True)
+
+
+# Tests the --list mode.
+def TestList():
+    zip_name = 'archive.zip'
+    logging.info(f'Test {zip_name!r}, options = --list')
+    zip_path = os.path.join(script_dir, 'data', zip_name)
+    want = {
+        'artificial': ('Directory', None),
+        'hello.sh': ('File', 693),
+        'non-ascii/αβ.txt': ('File', 104),
+        'romeo.txt': ('File', 942),
+    }
+
+    p = subprocess.run(
+        [mount_program, '--list=json', zip_path],
+        check=True, capture_output=True, encoding='UTF-8',
+    )
+    items = {}
+    for line in p.stdout.splitlines():
+        item = json.loads(line)
+        items[item['path']] = (item['type'], item['size'])
+
+    for path, (want_type, want_size) in want.items():
+        got_type, got_size = items.get(path, (None, None))
+        if got_type != want_type or want_size not in (None, got_size):
+            LogError(f'Mismatch for {path!r} in --list=json: {items.get(path)}')
+
+    p = subprocess.run(
+        [mount_program, '--list=nul', zip_path],
+        check=True, capture_output=True, encoding='UTF-8',
+    )
+    records = p.stdout.split('\0')
+    if records[-1] != '' or len(records) - 1 != len(items):
+        LogError(f'Mismatch in --list=nul: {records}')
+    elif not any(r.startswith('-rw-r--r-- 942 ') and r.endswith(' romeo.txt')
+                 for r in records):
+        LogError(f'Missing romeo.txt in --list=nul: {records}')
+
+    # An entry name that isn't valid UTF-8 still gives valid JSON.
+    with tempfile.TemporaryDirectory() as tmp:
+        tar_path = os.path.join(tmp, 'invalid-utf8.tar')
+        with tarfile.open(tar_path, 'w', format=tarfile.GNU_FORMAT,
+                          encoding='UTF-8', errors='surrogateescape') as t:
+            t.addfile(tarfile.TarInfo('bad\udcff.txt'))
+        p = subprocess.run(
+            [mount_program, '--list=json', tar_path],
+            check=True, capture_output=True,
+        )
+        try:
+            paths = [json.loads(line)['path']
+                     for line in p.stdout.decode('UTF-8').splitlines()]
+            if paths != ['bad\ufffd.txt']:
+                LogError(f'Mismatch in --list=json: {paths}')
+        except ValueError as e:
+            LogError(f'Invalid JSON in --list=json: {e}: {p.stdout!r}')
+
+
+# Tests that --extract writes the same files as the ones in the mounted archive.
+def TestExtract(zip_name):
+    logging.info(f'Test {zip_name!r}, options = --extract')
+    zip_path = os.path.join(script_dir, 'data', zip_name)
+    want_tree, _ = MountArchiveAndGetTree(zip_name)
+    with tempfile.TemporaryDirectory() as tmp:
+        dest = os.path.join(tmp, 'out')
+        subprocess.run(
+            [mount_program, f'--extract={dest}', zip_path],
+            check=True, capture_output=True, encoding='UTF-8',
+        )
+        got_tree = GetTree(dest)
+
+    for path, want in want_tree.items():
+        got = got_tree.get(path)
+        if got is None:
+            LogError(f'Missing {path!r} in --extract of {zip_name!r}')
+            continue
+
+        # Implicit directories get the current time as mtime.
+        keys = ['mode', 'size', 'md5', 'target']
+        if not want['mode'].startswith('d'):
+            keys.append('mtime')
+
+        for key in keys:
+            if path != '.' and want.get(key) != got.get(key):
+                LogError(f'Mismatch for {key} of {path!r} in --extract of '
+                         f'{zip_name!r}: want {want.get(key)}, got {got.get(key)}')
+
+    for path in got_tree.keys() - want_tree.keys():
+        LogError(f'Unexpected {path!r} in --extract of {zip_name!r}')
+
+
+# Tests that the mount-time profile is written as JSON.
+def TestProfile():
+    zip_name = 'archive.tar.gz'
+    logging.info(f'Test {zip_name!r}, options = profile')
+    with tempfile.TemporaryDirectory() as tmp:
+        profile_path = os.path.join(tmp, 'profile.json')
+        MountArchiveAndGetTree(zip_name, options=['-o', f'profile={profile_path}'])
+        try:
+            with open(profile_path) as f:
+                profile = json.load(f)
+        except (OSError, ValueError) as e:
+            LogError(f'Cannot read profile: {e}')
+            return
+
+        for phase in ['archive_io', 'decompression', 'header_parsing',
+                      'tree_building', 'collisions', 'hardlinks', 'cache_write']:
+            if phase not in profile['phases']:
+                LogError(f'Missing phase {phase!r} in profile')
+
+        archive_size = os.path.getsize(os.path.join(data_dir, zip_name))
+        if not 0 < profile['compressed_bytes'] <= archive_size:
+            LogError(f'Mismatch for compressed_bytes: {profile}')
+
+        if profile['uncompressed_bytes'] <= 0:
+            LogError(f'Mismatch for uncompressed_bytes: {profile}')
+
+
 logging.getLogger().setLevel('INFO')
 
 TestArchiveWithOptions()
 TestArchiveWithOptions(['-o', 'nocache'])
+TestArchiveWithOptions(['-o', 'mmap'])
+TestArchiveWithOptions(['-o', 'nocache,readsize=16384'])
+CheckArchiveMountingError('archive.zip', 1, ['-o', 'readsize=1000000000000'])
 TestHardlinks()
 TestHardlinks(['-o', 'nocache'])
 TestArchiveWithSpecialFiles()
 TestEncryptedArchive()
 TestEncryptedArchive(['-o', 'nocache'])
 TestInvalidArchive()
+TestLimits()
 TestMasks()
 TestArchiveWithManyFiles()
+TestTrace()
+TestProfile()
+TestRecord()
+TestReadFailures()
+TestAccessPatterns()
+TestXattrs()
+TestXattrs(['-o', 'nocache'])
+TestTarExport()
+TestManifest()
+TestManifest(['-o', 'nocache'])
+TestList()
+TestExtract('archive.zip')
+TestExtract('hardlinks.tgz')
+TestExtract('sparse.tar.gz')
 TestBigArchiveRandomOrder(['-o', 'direct_io'])
+TestBigArchiveRandomOrder(['-o', 'mmap'])
 TestBigArchiveStreamed(['-o', 'nocache,direct_io'])
 
 if error_count:
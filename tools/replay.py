@@ -0,0 +1,294 @@
+#!/usr/bin/python3
+
+# Copyright 2025 The Fuse-Archive Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Replays a recording written by 'fuse-archive -o record=FILE'.
+#
+# Mounts the archive on a fresh mount point, and re-issues the recorded
+# operations with their original timing, or as fast as possible with --fast.
+# The fresh mount records its own operations too, and the latencies of both
+# recordings are compared per operation type.
+#
+# Usage:
+#   replay.py [--fast] [--options OPTS] [--output report.json] ARCHIVE FILE
+#
+# The kernel caches attributes and file contents, so a replay against a mount
+# with different options might not reach fuse-archive with the same operations.
+# Pass the same mount options as the recorded mount, e.g. '--options direct_io'.
+
+import argparse
+import concurrent.futures
+import json
+import os
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HEADER = struct.Struct('<8sII')
+RECORD = struct.Struct('<QQqqqiHH')
+MAGIC = b'FARECORD'
+
+# Must match OpCode in src/main.cc.
+OPS = {
+    1: 'getattr',
+    2: 'readlink',
+    3: 'open',
+    4: 'read',
+    5: 'statfs',
+    6: 'release',
+    7: 'opendir',
+    8: 'readdir',
+    9: 'getxattr',
+    10: 'listxattr',
+}
+
+# Directory of this program.
+script_dir = os.path.dirname(os.path.realpath(__file__))
+
+# Path of the FUSE mounter.
+mount_program = os.path.join(script_dir, '..', 'out', 'fuse-archive')
+
+
+# Reads the records of the given recording file.
+# Returns a list of dicts sorted by start time.
+def ReadRecords(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    magic, record_size, _ = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        sys.exit(f'{path}: Not a fuse-archive recording')
+    if record_size != RECORD.size:
+        sys.exit(f'{path}: Unexpected record size {record_size}')
+
+    records = []
+    for fields in RECORD.iter_unpack(data[HEADER.size:]):
+        start, end, ino, offset, size, result, thread, op = fields
+        records.append({
+            'start': start,
+            'end': end,
+            'ino': ino,
+            'offset': offset,
+            'size': size,
+            'result': result,
+            'thread': thread,
+            'op': OPS.get(op, f'op{op}'),
+        })
+
+    records.sort(key=lambda r: r['start'])
+    return records
+
+
+# Maps the inode numbers of the mounted tree to their paths.
+def MapInodes(root):
+    paths = {os.lstat(root).st_ino: root}
+    for dirpath, dirnames, filenames in os.walk(root):
+        for name in dirnames + filenames:
+            path = os.path.join(dirpath, name)
+            paths.setdefault(os.lstat(path).st_ino, path)
+    return paths
+
+
+# Re-issues the recorded operations through the mount point.
+class Replayer:
+    def __init__(self, root, paths):
+        self.root = root
+        self.paths = paths
+        self.fds = {}
+        self.lock = threading.Lock()
+        self.errors = 0
+
+    # Gets a file descriptor for the given inode, opening it if needed.
+    def GetFd(self, ino, path):
+        with self.lock:
+            fds = self.fds.get(ino)
+            if fds:
+                return fds[-1]
+        fd = os.open(path, os.O_RDONLY)
+        with self.lock:
+            self.fds.setdefault(ino, []).append(fd)
+        return fd
+
+    def Close(self, ino):
+        with self.lock:
+            fds = self.fds.get(ino)
+            fd = fds.pop() if fds else None
+        if fd is not None:
+            os.close(fd)
+
+    # Issues an operation. Returns its latency in seconds.
+    def Issue(self, r):
+        path = self.paths.get(r['ino'])
+        op = r['op']
+        start = time.monotonic()
+        try:
+            if op == 'statfs':
+                os.statvfs(self.root)
+            elif path is None:
+                # The target didn't exist, or the recording lacks its inode.
+                os.lstat(os.path.join(self.root, '.fuse-archive-replay-miss'))
+            elif op == 'getattr':
+                os.lstat(path)
+            elif op == 'readlink':
+                os.readlink(path)
+            elif op == 'open':
+                fd = os.open(path, os.O_RDONLY)
+                with self.lock:
+                    self.fds.setdefault(r['ino'], []).append(fd)
+            elif op == 'read':
+                os.pread(self.GetFd(r['ino'], path), r['size'], r['offset'])
+            elif op == 'release':
+                self.Close(r['ino'])
+            elif op == 'opendir':
+                os.close(os.open(path, os.O_RDONLY | os.O_DIRECTORY))
+            elif op == 'readdir':
+                os.listdir(path)
+            elif op == 'getxattr':
+                os.getxattr(path, 'user.archive.index', follow_symlinks=False)
+            elif op == 'listxattr':
+                os.listxattr(path, follow_symlinks=False)
+        except OSError:
+            self.errors += 1
+        return time.monotonic() - start
+
+    def CloseAll(self):
+        for fds in self.fds.values():
+            for fd in fds:
+                os.close(fd)
+        self.fds.clear()
+
+
+# Replays the records. Returns the client-side latencies by operation type.
+def Replay(replayer, records, fast):
+    latencies = {}
+
+    def Run(r):
+        latencies.setdefault(r['op'], []).append(replayer.Issue(r))
+
+    if fast:
+        for r in records:
+            Run(r)
+        return latencies
+
+    # Issue each operation at its original time relative to the first one, on
+    # a pool of threads so that overlapping operations still overlap.
+    first = records[0]['start'] if records else 0
+    start = time.monotonic()
+    with concurrent.futures.ThreadPoolExecutor(max_workers=64) as pool:
+        for r in records:
+            delay = (r['start'] - first) / 1e9 - (time.monotonic() - start)
+            if delay > 0:
+                time.sleep(delay)
+            pool.submit(Run, r)
+    return latencies
+
+
+def Summarize(latencies):
+    if not latencies:
+        return {}
+    q = statistics.quantiles(latencies, n=100, method='inclusive')
+    return {
+        'count': len(latencies),
+        'p50_us': q[49] * 1e6,
+        'p99_us': q[98] * 1e6,
+        'mean_us': statistics.fmean(latencies) * 1e6,
+    }
+
+
+# Groups the latencies of recorded operations by operation type.
+def GetLatencies(records):
+    latencies = {}
+    for r in records:
+        latencies.setdefault(r['op'], []).append((r['end'] - r['start']) / 1e9)
+    return latencies
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Replay a fuse-archive recording')
+    parser.add_argument('archive', help='archive that was mounted')
+    parser.add_argument('recording', help='recording file')
+    parser.add_argument('--fast', action='store_true',
+                        help='replay as fast as possible')
+    parser.add_argument('--options', default='',
+                        help='comma-separated mount options')
+    parser.add_argument('--output', help='JSON report file')
+    args = parser.parse_args()
+
+    records = ReadRecords(args.recording)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        mount_point = os.path.join(tmp, 'mnt')
+        replay_recording = os.path.join(tmp, 'replay.rec')
+        options = ','.join(filter(None, [args.options,
+                                         f'record={replay_recording}']))
+        subprocess.run(
+            [mount_program, '-o', options, args.archive, mount_point],
+            check=True,
+        )
+        try:
+            replayer = Replayer(mount_point, MapInodes(mount_point))
+            start = time.monotonic()
+            client = Replay(replayer, records, args.fast)
+            seconds = time.monotonic() - start
+            replayer.CloseAll()
+        finally:
+            subprocess.run(['fusermount', '-u', mount_point], check=True)
+
+        replayed = ReadRecords(replay_recording)
+
+    recorded = GetLatencies(records)
+    served = GetLatencies(replayed)
+    report = {
+        'seconds': seconds,
+        'errors': replayer.errors,
+        'ops': {},
+    }
+
+    print(f"{'op':<10} {'count':>8} {'recorded p50':>14} {'replayed p50':>14}"
+          f" {'change':>8} {'recorded p99':>14} {'replayed p99':>14}"
+          f" {'change':>8} {'client p50':>12}")
+    for op in sorted(recorded.keys() | served.keys()):
+        a = Summarize(recorded.get(op, []))
+        b = Summarize(served.get(op, []))
+        c = Summarize(client.get(op, []))
+        report['ops'][op] = {'recorded': a, 'replayed': b, 'client': c}
+
+        def Change(key):
+            if not a.get(key) or key not in b:
+                return ''
+            return f'{(b[key] - a[key]) / a[key] * 100:+.1f}%'
+
+        print(f"{op:<10} {a.get('count', 0):>8}"
+              f" {a.get('p50_us', 0):>11.1f} us {b.get('p50_us', 0):>11.1f} us"
+              f" {Change('p50_us'):>8}"
+              f" {a.get('p99_us', 0):>11.1f} us {b.get('p99_us', 0):>11.1f} us"
+              f" {Change('p99_us'):>8}"
+              f" {c.get('p50_us', 0):>9.1f} us")
+
+    print(f'Replayed {len(records)} operations in {seconds:.3f} s'
+          f' with {replayer.errors} errors')
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
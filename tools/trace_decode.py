@@ -0,0 +1,133 @@
+#!/usr/bin/python3
+
+# Copyright 2025 The Fuse-Archive Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Decodes a trace dump written by 'fuse-archive -o trace=FILE'.
+#
+# Usage:
+#   trace_decode.py FILE            Prints the events as text.
+#   trace_decode.py --chrome FILE   Prints the events as Chrome trace JSON,
+#                                   which can be loaded in chrome://tracing or
+#                                   https://ui.perfetto.dev.
+
+import argparse
+import json
+import struct
+import sys
+
+HEADER = struct.Struct('<8sII')
+RECORD = struct.Struct('<QQqqqIHH')
+MAGIC = b'FATRACE1'
+
+# Must match TraceEvent in src/main.cc.
+EVENTS = {
+    1: 'ReaderCreate',
+    2: 'ReaderDelete',
+    3: 'ReaderReuse',
+    4: 'AdvanceIndex',
+    5: 'AdvanceOffset',
+    6: 'ReaderRead',
+    7: 'SideBufferHit',
+    8: 'SideBufferMiss',
+    9: 'FuseOpen',
+    10: 'FuseRead',
+    11: 'FuseRelease',
+}
+
+
+# Reads the records of the given trace dump file.
+# Returns a list of dicts sorted by timestamp.
+def ReadRecords(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    magic, record_size, _ = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        sys.exit(f'{path}: Not a fuse-archive trace file')
+    if record_size != RECORD.size:
+        sys.exit(f'{path}: Unexpected record size {record_size}')
+
+    records = []
+    for fields in RECORD.iter_unpack(data[HEADER.size:]):
+        ts, duration, index, offset, length, reader, thread, event = fields
+        records.append({
+            'ts': ts,
+            'duration': duration,
+            'index': index,
+            'offset': offset,
+            'length': length,
+            'reader': reader,
+            'thread': thread,
+            'event': EVENTS.get(event, f'Event{event}'),
+        })
+
+    records.sort(key=lambda r: r['ts'])
+    return records
+
+
+def PrintText(records):
+    start = records[0]['ts'] if records else 0
+    for r in records:
+        print(
+            f"{(r['ts'] - start) / 1e3:14.3f} us  T{r['thread']:<3}"
+            f" {r['event']:<14} reader={r['reader']} index={r['index']}"
+            f" offset={r['offset']} length={r['length']}"
+            f" duration={r['duration'] / 1e3:.3f} us"
+        )
+
+
+def PrintChrome(records):
+    events = []
+    for r in records:
+        event = {
+            'name': r['event'],
+            'pid': 1,
+            'tid': r['thread'],
+            'ts': r['ts'] / 1e3,
+            'args': {
+                'reader': r['reader'],
+                'index': r['index'],
+                'offset': r['offset'],
+                'length': r['length'],
+            },
+        }
+        if r['duration']:
+            event['ph'] = 'X'
+            event['dur'] = r['duration'] / 1e3
+        else:
+            event['ph'] = 'i'
+            event['s'] = 't'
+        events.append(event)
+
+    json.dump({'traceEvents': events, 'displayTimeUnit': 'ns'}, sys.stdout)
+    print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a fuse-archive trace')
+    parser.add_argument('--chrome', action='store_true',
+                        help='print Chrome trace JSON instead of text')
+    parser.add_argument('file', help='trace dump file')
+    args = parser.parse_args()
+
+    records = ReadRecords(args.file)
+    if args.chrome:
+        PrintChrome(records)
+    else:
+        PrintText(records)
+
+
+if __name__ == '__main__':
+    main()